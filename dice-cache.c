@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: GPL-2.0
+// dice-cache.c - a part of driver for DICE based devices
+//
+// Cache of clock capabilities and stream formats detected for each unit, so
+// that probe after hotplug or bus reset skips the detection. The cache is
+// validated by the formats of streams in the current mode.
+
+#include <linux/firmware.h>
+
+#include "dice.h"
+
+static bool format_cache = true;
+module_param(format_cache, bool, 0644);
+MODULE_PARM_DESC(format_cache, "Cache stream formats per unit for the following probes (default: true)");
+
+// 'DICE' in little endian.
+#define CACHE_BLOB_MAGIC	0x45434944
+
+struct cache_entry {
+	struct list_head list;
+	u64 guid;
+	u32 version;
+
+	unsigned int clock_caps;
+	unsigned int tx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	unsigned int rx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	unsigned int tx_midi_ports[MAX_STREAMS];
+	unsigned int rx_midi_ports[MAX_STREAMS];
+	unsigned int tx_converter_latency[SND_DICE_RATE_MODE_COUNT];
+	unsigned int rx_converter_latency[SND_DICE_RATE_MODE_COUNT];
+	unsigned int undetected_modes;
+	char tx_channel_names[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT][SND_DICE_CHANNEL_NAMES_SIZE];
+	char rx_channel_names[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT][SND_DICE_CHANNEL_NAMES_SIZE];
+	struct snd_dice_ext_section_info ext_sections[SND_DICE_EXT_SECTION_COUNT];
+};
+
+// The layout of firmware blob, 'dice/<GUID in 16 hex digits>.bin', to preload
+// the cache. All of numeric fields are in little endian.
+struct cache_blob {
+	__le32 magic;
+	__le32 version;
+	__le32 clock_caps;
+	__le32 tx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	__le32 rx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	__le32 tx_midi_ports[MAX_STREAMS];
+	__le32 rx_midi_ports[MAX_STREAMS];
+	__le32 tx_converter_latency[SND_DICE_RATE_MODE_COUNT];
+	__le32 rx_converter_latency[SND_DICE_RATE_MODE_COUNT];
+	__le32 undetected_modes;
+	struct {
+		__le32 offset;
+		__le32 size;
+	} __packed ext_sections[SND_DICE_EXT_SECTION_COUNT];
+	char tx_channel_names[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT][SND_DICE_CHANNEL_NAMES_SIZE];
+	char rx_channel_names[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT][SND_DICE_CHANNEL_NAMES_SIZE];
+} __packed;
+
+static LIST_HEAD(cache_entries);
+static DEFINE_MUTEX(cache_mutex);
+
+static u64 get_guid(struct snd_dice *dice)
+{
+	struct fw_device *device = fw_parent_device(dice->unit);
+
+	return ((u64)device->config_rom[3] << 32) | device->config_rom[4];
+}
+
+static struct cache_entry *find_entry(u64 guid, u32 version)
+{
+	struct cache_entry *entry;
+
+	list_for_each_entry(entry, &cache_entries, list) {
+		if (entry->guid == guid && entry->version == version)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static struct cache_entry *load_blob(struct snd_dice *dice, u64 guid,
+				     u32 version)
+{
+	const struct firmware *fw;
+	const struct cache_blob *blob;
+	struct cache_entry *entry = NULL;
+	char name[32];
+	unsigned int i, j;
+
+	snprintf(name, sizeof(name), "dice/%016llx.bin", guid);
+	if (request_firmware_direct(&fw, name, &dice->unit->device) < 0)
+		return NULL;
+
+	if (fw->size != sizeof(*blob))
+		goto end;
+	blob = (const struct cache_blob *)fw->data;
+	if (le32_to_cpu(blob->magic) != CACHE_BLOB_MAGIC ||
+	    le32_to_cpu(blob->version) != version)
+		goto end;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		goto end;
+
+	entry->guid = guid;
+	entry->version = version;
+	entry->clock_caps = le32_to_cpu(blob->clock_caps);
+	for (i = 0; i < MAX_STREAMS; ++i) {
+		for (j = 0; j < SND_DICE_RATE_MODE_COUNT; ++j) {
+			entry->tx_pcm_chs[i][j] =
+					le32_to_cpu(blob->tx_pcm_chs[i][j]);
+			entry->rx_pcm_chs[i][j] =
+					le32_to_cpu(blob->rx_pcm_chs[i][j]);
+		}
+		entry->tx_midi_ports[i] = le32_to_cpu(blob->tx_midi_ports[i]);
+		entry->rx_midi_ports[i] = le32_to_cpu(blob->rx_midi_ports[i]);
+	}
+	for (i = 0; i < SND_DICE_RATE_MODE_COUNT; ++i) {
+		entry->tx_converter_latency[i] =
+				le32_to_cpu(blob->tx_converter_latency[i]);
+		entry->rx_converter_latency[i] =
+				le32_to_cpu(blob->rx_converter_latency[i]);
+	}
+	entry->undetected_modes = le32_to_cpu(blob->undetected_modes);
+	for (i = 0; i < SND_DICE_EXT_SECTION_COUNT; ++i) {
+		entry->ext_sections[i].offset =
+				le32_to_cpu(blob->ext_sections[i].offset);
+		entry->ext_sections[i].size =
+				le32_to_cpu(blob->ext_sections[i].size);
+	}
+	memcpy(entry->tx_channel_names, blob->tx_channel_names,
+	       sizeof(entry->tx_channel_names));
+	memcpy(entry->rx_channel_names, blob->rx_channel_names,
+	       sizeof(entry->rx_channel_names));
+
+	list_add_tail(&entry->list, &cache_entries);
+end:
+	release_firmware(fw);
+	return entry;
+}
+
+int snd_dice_cache_restore(struct snd_dice *dice)
+{
+	struct cache_entry *entry;
+	u64 guid = get_guid(dice);
+	u32 version = dice->global_version;
+	int err = 0;
+
+	// Firmware without GLOBAL_VERSION register is not cached, since the
+	// entry can not be validated.
+	if (!format_cache || version == 0)
+		return -ENOENT;
+
+	mutex_lock(&cache_mutex);
+
+	entry = find_entry(guid, version);
+	if (!entry)
+		entry = load_blob(dice, guid, version);
+
+	// GLOBAL_VERSION is for the layout of registers. The formats in the
+	// current mode are compared since the unit can change them between
+	// probes. The entry is dropped at mismatch.
+	if (entry &&
+	    snd_dice_stream_check_formats(dice, entry->clock_caps,
+					  entry->tx_pcm_chs,
+					  entry->rx_pcm_chs,
+					  entry->tx_midi_ports,
+					  entry->rx_midi_ports) < 0) {
+		list_del(&entry->list);
+		kfree(entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		err = -ENOENT;
+	} else {
+		dice->clock_caps = entry->clock_caps;
+		memcpy(dice->tx_pcm_chs, entry->tx_pcm_chs,
+		       sizeof(dice->tx_pcm_chs));
+		memcpy(dice->rx_pcm_chs, entry->rx_pcm_chs,
+		       sizeof(dice->rx_pcm_chs));
+		memcpy(dice->tx_midi_ports, entry->tx_midi_ports,
+		       sizeof(dice->tx_midi_ports));
+		memcpy(dice->rx_midi_ports, entry->rx_midi_ports,
+		       sizeof(dice->rx_midi_ports));
+		memcpy(dice->tx_converter_latency, entry->tx_converter_latency,
+		       sizeof(dice->tx_converter_latency));
+		memcpy(dice->rx_converter_latency, entry->rx_converter_latency,
+		       sizeof(dice->rx_converter_latency));
+		dice->undetected_modes = entry->undetected_modes;
+		memcpy(dice->tx_channel_names, entry->tx_channel_names,
+		       sizeof(dice->tx_channel_names));
+		memcpy(dice->rx_channel_names, entry->rx_channel_names,
+		       sizeof(dice->rx_channel_names));
+		memcpy(dice->ext_sections, entry->ext_sections,
+		       sizeof(dice->ext_sections));
+		dice->formats_cached = true;
+	}
+
+	mutex_unlock(&cache_mutex);
+
+	return err;
+}
+
+void snd_dice_cache_store(struct snd_dice *dice)
+{
+	struct cache_entry *entry;
+	u64 guid = get_guid(dice);
+	u32 version = dice->global_version;
+
+	if (!format_cache || version == 0)
+		return;
+
+	mutex_lock(&cache_mutex);
+
+	entry = find_entry(guid, version);
+	if (!entry) {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry)
+			goto end;
+		entry->guid = guid;
+		entry->version = version;
+		list_add_tail(&entry->list, &cache_entries);
+	}
+
+	entry->clock_caps = dice->clock_caps;
+	memcpy(entry->tx_pcm_chs, dice->tx_pcm_chs, sizeof(entry->tx_pcm_chs));
+	memcpy(entry->rx_pcm_chs, dice->rx_pcm_chs, sizeof(entry->rx_pcm_chs));
+	memcpy(entry->tx_midi_ports, dice->tx_midi_ports,
+	       sizeof(entry->tx_midi_ports));
+	memcpy(entry->rx_midi_ports, dice->rx_midi_ports,
+	       sizeof(entry->rx_midi_ports));
+	memcpy(entry->tx_converter_latency, dice->tx_converter_latency,
+	       sizeof(entry->tx_converter_latency));
+	memcpy(entry->rx_converter_latency, dice->rx_converter_latency,
+	       sizeof(entry->rx_converter_latency));
+	entry->undetected_modes = dice->undetected_modes;
+	memcpy(entry->tx_channel_names, dice->tx_channel_names,
+	       sizeof(entry->tx_channel_names));
+	memcpy(entry->rx_channel_names, dice->rx_channel_names,
+	       sizeof(entry->rx_channel_names));
+	memcpy(entry->ext_sections, dice->ext_sections,
+	       sizeof(entry->ext_sections));
+end:
+	mutex_unlock(&cache_mutex);
+}
+
+void snd_dice_cache_clear(void)
+{
+	struct cache_entry *entry, *next;
+
+	mutex_lock(&cache_mutex);
+	list_for_each_entry_safe(entry, next, &cache_entries, list) {
+		list_del(&entry->list);
+		kfree(entry);
+	}
+	mutex_unlock(&cache_mutex);
+}
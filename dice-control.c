@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: GPL-2.0
+// dice-control.c - a part of driver for DICE based devices
+//
+// Read-only control elements for the status of clock. The values come from the
+// shadow of global section and the counters of clock events maintained by
+// notification, thus no transaction is initiated by the get callbacks. A change
+// of value is notified to the subscribers of control device.
+
+#include "dice.h"
+
+#define CLOCK_SOURCE_COUNT	(CLOCK_SOURCE_INTERNAL + 1)
+
+#define EXT_STATUS_LOCKED_MASK	GENMASK(SND_DICE_EXT_SOURCE_COUNT - 1, 0)
+#define EXT_STATUS_SLIP_MASK	(EXT_STATUS_LOCKED_MASK << 16)
+
+struct clock_source_names {
+	const char *items[CLOCK_SOURCE_COUNT];
+	char buf[CLOCK_SOURCE_NAMES_SIZE];
+};
+
+static int clock_source_info(struct snd_kcontrol *kctl,
+			     struct snd_ctl_elem_info *info)
+{
+	struct clock_source_names *names =
+			(struct clock_source_names *)kctl->private_value;
+
+	return snd_ctl_enum_info(info, 1, CLOCK_SOURCE_COUNT, names->items);
+}
+
+static int clock_source_get(struct snd_kcontrol *kctl,
+			    struct snd_ctl_elem_value *uval)
+{
+	struct snd_dice *dice = snd_kcontrol_chip(kctl);
+	unsigned int source;
+
+	spin_lock_irq(&dice->lock);
+	source = dice->global_shadow.clock_select & CLOCK_SOURCE_MASK;
+	spin_unlock_irq(&dice->lock);
+
+	if (source >= CLOCK_SOURCE_COUNT)
+		return -EIO;
+	uval->value.enumerated.item[0] = source;
+
+	return 0;
+}
+
+static void clock_source_free(struct snd_kcontrol *kctl)
+{
+	kfree((void *)kctl->private_value);
+}
+
+static int nominal_rate_info(struct snd_kcontrol *kctl,
+			     struct snd_ctl_elem_info *info)
+{
+	info->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	info->count = 1;
+	info->value.integer.min = 0;
+	info->value.integer.max = snd_dice_rates[SND_DICE_RATES_COUNT - 1];
+	info->value.integer.step = 1;
+
+	return 0;
+}
+
+static int nominal_rate_get(struct snd_kcontrol *kctl,
+			    struct snd_ctl_elem_value *uval)
+{
+	struct snd_dice *dice = snd_kcontrol_chip(kctl);
+	unsigned int index;
+
+	spin_lock_irq(&dice->lock);
+	index = (dice->global_shadow.status & STATUS_NOMINAL_RATE_MASK) >>
+		CLOCK_RATE_SHIFT;
+	spin_unlock_irq(&dice->lock);
+
+	// Zero for CLOCK_RATE_NONE and the others.
+	if (index < SND_DICE_RATES_COUNT)
+		uval->value.integer.value[0] = snd_dice_rates[index];
+	else
+		uval->value.integer.value[0] = 0;
+
+	return 0;
+}
+
+static int clock_locked_get(struct snd_kcontrol *kctl,
+			    struct snd_ctl_elem_value *uval)
+{
+	struct snd_dice *dice = snd_kcontrol_chip(kctl);
+
+	spin_lock_irq(&dice->lock);
+	uval->value.integer.value[0] =
+		!!(dice->global_shadow.status & STATUS_SOURCE_LOCKED);
+	spin_unlock_irq(&dice->lock);
+
+	return 0;
+}
+
+static int ext_locked_info(struct snd_kcontrol *kctl,
+			   struct snd_ctl_elem_info *info)
+{
+	info->type = SNDRV_CTL_ELEM_TYPE_BOOLEAN;
+	info->count = SND_DICE_EXT_SOURCE_COUNT;
+	info->value.integer.min = 0;
+	info->value.integer.max = 1;
+
+	return 0;
+}
+
+static int ext_locked_get(struct snd_kcontrol *kctl,
+			  struct snd_ctl_elem_value *uval)
+{
+	struct snd_dice *dice = snd_kcontrol_chip(kctl);
+	u32 ext_status;
+	unsigned int i;
+
+	spin_lock_irq(&dice->lock);
+	ext_status = dice->global_shadow.ext_status;
+	spin_unlock_irq(&dice->lock);
+
+	for (i = 0; i < SND_DICE_EXT_SOURCE_COUNT; ++i)
+		uval->value.integer.value[i] = !!(ext_status & BIT(i));
+
+	return 0;
+}
+
+static int ext_counter_info(struct snd_kcontrol *kctl,
+			    struct snd_ctl_elem_info *info)
+{
+	info->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	info->count = SND_DICE_EXT_SOURCE_COUNT;
+	info->value.integer.min = 0;
+	info->value.integer.max = INT_MAX;
+	info->value.integer.step = 1;
+
+	return 0;
+}
+
+static int ext_slips_get(struct snd_kcontrol *kctl,
+			 struct snd_ctl_elem_value *uval)
+{
+	struct snd_dice *dice = snd_kcontrol_chip(kctl);
+	struct snd_firewire_dice_clock_source_stats *sources =
+						dice->clock_stats.sources;
+	unsigned int i;
+
+	spin_lock_irq(&dice->lock);
+	for (i = 0; i < SND_DICE_EXT_SOURCE_COUNT; ++i)
+		uval->value.integer.value[i] =
+				min_t(u32, sources[i].slips, INT_MAX);
+	spin_unlock_irq(&dice->lock);
+
+	return 0;
+}
+
+static int ext_unlocks_get(struct snd_kcontrol *kctl,
+			   struct snd_ctl_elem_value *uval)
+{
+	struct snd_dice *dice = snd_kcontrol_chip(kctl);
+	struct snd_firewire_dice_clock_source_stats *sources =
+						dice->clock_stats.sources;
+	unsigned int i;
+
+	spin_lock_irq(&dice->lock);
+	for (i = 0; i < SND_DICE_EXT_SOURCE_COUNT; ++i)
+		uval->value.integer.value[i] =
+				min_t(u32, sources[i].unlocks, INT_MAX);
+	spin_unlock_irq(&dice->lock);
+
+	return 0;
+}
+
+static const struct snd_kcontrol_new controls[SND_DICE_CONTROL_COUNT] = {
+	[SND_DICE_CONTROL_CLOCK_SOURCE] = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+		.name	= "Clock Source",
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ,
+		.info	= clock_source_info,
+		.get	= clock_source_get,
+	},
+	[SND_DICE_CONTROL_NOMINAL_RATE] = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+		.name	= "Nominal Sampling Rate",
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ,
+		.info	= nominal_rate_info,
+		.get	= nominal_rate_get,
+	},
+	[SND_DICE_CONTROL_CLOCK_LOCKED] = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+		.name	= "Clock Source Locked",
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ,
+		.info	= snd_ctl_boolean_mono_info,
+		.get	= clock_locked_get,
+	},
+	// The elements of arrays are in the order of SND_DICE_EXT_SOURCE_COUNT.
+	[SND_DICE_CONTROL_EXT_LOCKED] = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+		.name	= "External Source Locked",
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ,
+		.info	= ext_locked_info,
+		.get	= ext_locked_get,
+	},
+	[SND_DICE_CONTROL_EXT_SLIPS] = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+		.name	= "External Source Slips",
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ,
+		.info	= ext_counter_info,
+		.get	= ext_slips_get,
+	},
+	[SND_DICE_CONTROL_EXT_UNLOCKS] = {
+		.iface	= SNDRV_CTL_ELEM_IFACE_CARD,
+		.name	= "External Source Unlocks",
+		.access	= SNDRV_CTL_ELEM_ACCESS_READ,
+		.info	= ext_counter_info,
+		.get	= ext_unlocks_get,
+	},
+};
+
+// The names are separated by backslash and terminated by two backslashes.
+// Any source without name keeps the label in driver.
+static void parse_clock_source_names(struct snd_dice *dice,
+				     struct clock_source_names *names)
+{
+	static const char *const labels[CLOCK_SOURCE_COUNT] = {
+		"AES1", "AES2", "AES3", "AES4", "AES", "ADAT", "TDIF", "WC",
+		"ARX1", "ARX2", "ARX3", "ARX4", "Internal",
+	};
+	unsigned int i, count;
+	char *p, *s;
+	int err;
+
+	memcpy(names->items, labels, sizeof(labels));
+
+	// Old firmware has no field for the names.
+	if (dice->global_version == 0)
+		return;
+
+	err = snd_dice_transaction_read_global(dice, GLOBAL_CLOCK_SOURCE_NAMES,
+					       names->buf, sizeof(names->buf));
+	if (err < 0)
+		return;
+
+	// DICE strings are returned in "always-wrong" endianness.
+	for (i = 0; i < sizeof(names->buf); i += 4)
+		swab32s((u32 *)&names->buf[i]);
+	names->buf[sizeof(names->buf) - 1] = '\0';
+
+	p = names->buf;
+	count = 0;
+	while (count < CLOCK_SOURCE_COUNT && (s = strsep(&p, "\\")) != NULL) {
+		if (*s == '\0')
+			break;
+		names->items[count++] = s;
+	}
+}
+
+int snd_dice_create_control(struct snd_dice *dice)
+{
+	struct clock_source_names *names;
+	struct snd_kcontrol *kctl;
+	unsigned int i;
+	int err;
+
+	names = kzalloc(sizeof(*names), GFP_KERNEL);
+	if (!names)
+		return -ENOMEM;
+	parse_clock_source_names(dice, names);
+
+	for (i = 0; i < SND_DICE_CONTROL_COUNT; ++i) {
+		kctl = snd_ctl_new1(&controls[i], dice);
+		if (!kctl) {
+			err = -ENOMEM;
+			goto error;
+		}
+
+		if (i == SND_DICE_CONTROL_CLOCK_SOURCE) {
+			kctl->private_value = (unsigned long)names;
+			kctl->private_free = clock_source_free;
+			names = NULL;
+		}
+
+		err = snd_ctl_add(dice->card, kctl);
+		if (err < 0)
+			goto error;
+
+		// The identifier is kept instead of the element, since
+		// notification can arrive after the element is released.
+		dice->control_ids[i] = kctl->id;
+	}
+
+	return 0;
+error:
+	kfree(names);
+	return err;
+}
+
+void snd_dice_control_notify(struct snd_dice *dice,
+			     const struct snd_dice_global_shadow *old)
+{
+	struct snd_dice_global_shadow *shadow = &dice->global_shadow;
+	unsigned int changed = 0;
+	unsigned int i;
+
+	spin_lock_irq(&dice->lock);
+	if ((shadow->clock_select ^ old->clock_select) & CLOCK_SOURCE_MASK)
+		changed |= BIT(SND_DICE_CONTROL_CLOCK_SOURCE);
+	if ((shadow->status ^ old->status) & STATUS_NOMINAL_RATE_MASK)
+		changed |= BIT(SND_DICE_CONTROL_NOMINAL_RATE);
+	if ((shadow->status ^ old->status) & STATUS_SOURCE_LOCKED)
+		changed |= BIT(SND_DICE_CONTROL_CLOCK_LOCKED);
+	if ((shadow->ext_status ^ old->ext_status) & EXT_STATUS_LOCKED_MASK)
+		changed |= BIT(SND_DICE_CONTROL_EXT_LOCKED);
+	// The counters are incremented by the bits in the refreshed shadow.
+	if (shadow->ext_status & EXT_STATUS_SLIP_MASK)
+		changed |= BIT(SND_DICE_CONTROL_EXT_SLIPS);
+	if (old->ext_status & ~shadow->ext_status & EXT_STATUS_LOCKED_MASK)
+		changed |= BIT(SND_DICE_CONTROL_EXT_UNLOCKS);
+	spin_unlock_irq(&dice->lock);
+
+	for (i = 0; i < SND_DICE_CONTROL_COUNT; ++i) {
+		// Not added yet.
+		if (dice->control_ids[i].numid == 0)
+			continue;
+		if (changed & BIT(i))
+			snd_ctl_notify(dice->card, SNDRV_CTL_EVENT_MASK_VALUE,
+				       &dice->control_ids[i]);
+	}
+}
@@ -37,7 +37,7 @@
 #define  EXT_APP_NUMBER_AUDIO		0x0000
 #define  EXT_APP_NUMBER_MIDI		0x0004
 #define  EXT_APP_NAMES			0x0008
-#define   EXT_APP_NAMES_SIZE		256
+#define   EXT_APP_NAMES_SIZE		SND_DICE_CHANNEL_NAMES_SIZE
 #define  EXT_APP_AC3			0x0108
 
 #define EXT_APP_CONFIG_LOW_ROUTER	0x0000
@@ -47,6 +47,17 @@
 #define EXT_APP_CONFIG_HIGH_ROUTER	0x4000
 #define EXT_APP_CONFIG_HIGH_STREAM	0x5000
 
+#define EXT_APP_CMD_OPCODE		0x0000
+#define  EXT_APP_CMD_EXECUTE		0x80000000
+#define  EXT_APP_CMD_RATE_LOW		0x00010000
+#define  EXT_APP_CMD_RATE_MIDDLE	0x00020000
+#define  EXT_APP_CMD_RATE_HIGH		0x00040000
+#define  EXT_APP_CMD_LD_ROUTER		0x00000001
+#define EXT_APP_CMD_RETURN		0x0004
+
+#define CMD_POLL_COUNT			10
+#define CMD_POLL_INTERVAL_MS		10
+
 static inline int read_transaction(struct snd_dice *dice, u64 section_addr,
 				   u32 offset, void *buf, size_t len)
 {
@@ -56,39 +67,204 @@ static inline int read_transaction(struct snd_dice *dice, u64 section_addr,
 				  section_addr + offset, buf, len, 0);
 }
 
-static int read_stream_entries(struct snd_dice *dice, u64 section_addr,
-			       u32 base_offset, unsigned int stream_count,
-			       unsigned int mode,
-			       unsigned int pcm_channels[MAX_STREAMS][3],
-			       unsigned int midi_ports[MAX_STREAMS])
+// The size of stream configuration block to cover entries of streams supported
+// by this driver.
+#define STREAM_CONFIG_SIZE \
+	(EXT_APP_STREAM_ENTRIES + EXT_APP_STREAM_ENTRY_SIZE * MAX_STREAMS * 2)
+
+// The maximum payload of asynchronous transaction which the link allows.
+static unsigned int get_max_payload(struct snd_dice *dice)
+{
+	struct fw_device *device = fw_parent_device(dice->unit);
+
+	return min(512u << device->max_speed, 2u << device->max_rec);
+}
+
+static int read_block(struct snd_dice *dice, u64 addr, void *buffer,
+		      unsigned int len)
 {
-	u32 entry_offset;
-	__be32 reg[2];
+	u8 *buf = buffer;
+	unsigned int max_payload = get_max_payload(dice);
 	int err;
+
+	while (len > 0) {
+		unsigned int size = min(len, max_payload);
+
+		err = read_transaction(dice, addr, 0, buf, size);
+		if (err < 0)
+			return err;
+
+		addr += size;
+		buf += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+int snd_dice_extension_read(struct snd_dice *dice,
+			    enum snd_dice_ext_section section,
+			    unsigned int offset, void *buf, unsigned int len)
+{
+	const struct snd_dice_ext_section_info *info = &dice->ext_sections[section];
+
+	if (offset + len > info->size)
+		return -EINVAL;
+
+	return read_block(dice, DICE_EXT_APP_SPACE + info->offset + offset,
+			  buf, len);
+}
+
+int snd_dice_extension_write(struct snd_dice *dice,
+			     enum snd_dice_ext_section section,
+			     unsigned int offset, void *buffer, unsigned int len)
+{
+	const struct snd_dice_ext_section_info *info = &dice->ext_sections[section];
+	unsigned int max_payload = get_max_payload(dice);
+	u64 addr = DICE_EXT_APP_SPACE + info->offset + offset;
+	u8 *buf = buffer;
+	int err;
+
+	if (offset + len > info->size)
+		return -EINVAL;
+
+	while (len > 0) {
+		unsigned int size = min(len, max_payload);
+
+		err = snd_fw_transaction(dice->unit,
+					 size == 4 ? TCODE_WRITE_QUADLET_REQUEST :
+						     TCODE_WRITE_BLOCK_REQUEST,
+					 addr, buf, size, 0);
+		if (err < 0)
+			return err;
+
+		addr += size;
+		buf += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+// Load the content of router section to the current configuration for the
+// mode.
+int snd_dice_extension_load_router(struct snd_dice *dice,
+				   enum snd_dice_rate_mode mode)
+{
+	static const u32 rate_flags[] = {
+		[SND_DICE_RATE_MODE_LOW]	= EXT_APP_CMD_RATE_LOW,
+		[SND_DICE_RATE_MODE_MIDDLE]	= EXT_APP_CMD_RATE_MIDDLE,
+		[SND_DICE_RATE_MODE_HIGH]	= EXT_APP_CMD_RATE_HIGH,
+	};
+	__be32 reg;
 	int i;
+	int err;
+
+	reg = cpu_to_be32(EXT_APP_CMD_EXECUTE | rate_flags[mode] |
+			  EXT_APP_CMD_LD_ROUTER);
+	err = snd_dice_extension_write(dice, SND_DICE_EXT_SECTION_CMD,
+				       EXT_APP_CMD_OPCODE, &reg, sizeof(reg));
+	if (err < 0)
+		return err;
 
-	for (i = 0; i < stream_count; ++i) {
-		entry_offset = base_offset + i * EXT_APP_STREAM_ENTRY_SIZE;
-		err = read_transaction(dice, section_addr,
-				    entry_offset + EXT_APP_NUMBER_AUDIO,
-				    reg, sizeof(reg));
+	// The unit clears the flag when the command is done.
+	for (i = 0; i < CMD_POLL_COUNT; ++i) {
+		msleep(CMD_POLL_INTERVAL_MS);
+
+		err = snd_dice_extension_read(dice, SND_DICE_EXT_SECTION_CMD,
+					      EXT_APP_CMD_OPCODE, &reg,
+					      sizeof(reg));
 		if (err < 0)
 			return err;
-		pcm_channels[i][mode] = be32_to_cpu(reg[0]);
-		midi_ports[i] = max(midi_ports[i], be32_to_cpu(reg[1]));
+		if (!(be32_to_cpu(reg) & EXT_APP_CMD_EXECUTE))
+			break;
 	}
+	if (i == CMD_POLL_COUNT)
+		return -ETIMEDOUT;
+
+	err = snd_dice_extension_read(dice, SND_DICE_EXT_SECTION_CMD,
+				      EXT_APP_CMD_RETURN, &reg, sizeof(reg));
+	if (err < 0)
+		return err;
+	if (reg != 0)
+		return -EIO;
 
 	return 0;
 }
 
+// Read the header and entries of the stream configuration block. The entries
+// of rx streams are put just after the ones of tx streams in the buffer.
+static int read_stream_config(struct snd_dice *dice, u64 addr, u8 *buf,
+			      unsigned int *tx_count, unsigned int *rx_count)
+{
+	unsigned int filled, len;
+	unsigned int count;
+	int err;
+
+	// The header and entries as many as the first transaction can carry.
+	filled = min_t(unsigned int, get_max_payload(dice), STREAM_CONFIG_SIZE);
+	err = read_block(dice, addr, buf, filled);
+	if (err < 0)
+		return err;
+
+	count = be32_to_cpup((__be32 *)(buf + EXT_APP_STREAM_TX_NUMBER));
+	*tx_count = min_t(unsigned int, count, MAX_STREAMS);
+	*rx_count = min_t(unsigned int,
+			  be32_to_cpup((__be32 *)(buf + EXT_APP_STREAM_RX_NUMBER)),
+			  MAX_STREAMS);
+
+	len = EXT_APP_STREAM_ENTRIES + *tx_count * EXT_APP_STREAM_ENTRY_SIZE;
+	if (count > MAX_STREAMS) {
+		// The entries of rx streams are not contiguous to the above.
+		if (len > filled) {
+			err = read_block(dice, addr + filled, buf + filled,
+					 len - filled);
+			if (err < 0)
+				return err;
+		}
+
+		return read_block(dice, addr + EXT_APP_STREAM_ENTRIES +
+				  count * EXT_APP_STREAM_ENTRY_SIZE,
+				  buf + len,
+				  *rx_count * EXT_APP_STREAM_ENTRY_SIZE);
+	}
+
+	len += *rx_count * EXT_APP_STREAM_ENTRY_SIZE;
+	if (len > filled)
+		err = read_block(dice, addr + filled, buf + filled, len - filled);
+
+	return err;
+}
+
+static void parse_stream_entry(const u8 *entry, unsigned int *pcm_channels,
+			       unsigned int *midi_ports, char *names)
+{
+	int i;
+
+	*pcm_channels = be32_to_cpup((__be32 *)(entry + EXT_APP_NUMBER_AUDIO));
+	*midi_ports = max(*midi_ports,
+			  be32_to_cpup((__be32 *)(entry + EXT_APP_NUMBER_MIDI)));
+
+	// DICE strings are returned in "always-wrong" endianness.
+	memcpy(names, entry + EXT_APP_NAMES, EXT_APP_NAMES_SIZE);
+	for (i = 0; i < EXT_APP_NAMES_SIZE; i += 4)
+		swab32s((u32 *)&names[i]);
+	names[EXT_APP_NAMES_SIZE - 1] = '\0';
+}
+
 static int detect_stream_formats(struct snd_dice *dice, u64 section_addr)
 {
-	u32 base_offset;
-	__be32 reg[2];
-	unsigned int stream_count;
+	unsigned int tx_count, rx_count;
+	const u8 *entry;
+	u8 *buf;
 	int mode;
+	int i;
 	int err = 0;
 
+	buf = kmalloc(STREAM_CONFIG_SIZE, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
 	for (mode = 0; mode < SND_DICE_RATE_MODE_COUNT; ++mode) {
 		unsigned int cap;
 
@@ -107,33 +283,29 @@ static int detect_stream_formats(struct snd_dice *dice, u64 section_addr)
 		if (!(cap & dice->clock_caps))
 			continue;
 
-		base_offset = 0x2000 * mode + 0x1000;
-
-		err = read_transaction(dice, section_addr,
-				       base_offset + EXT_APP_STREAM_TX_NUMBER,
-				       &reg, sizeof(reg));
+		err = read_stream_config(dice,
+					 section_addr + 0x2000 * mode + 0x1000,
+					 buf, &tx_count, &rx_count);
 		if (err < 0)
 			break;
 
-		base_offset += EXT_APP_STREAM_ENTRIES;
-		stream_count = be32_to_cpu(reg[0]);
-		err = read_stream_entries(dice, section_addr, base_offset,
-					  stream_count, mode,
-					  dice->tx_pcm_chs,
-					  dice->tx_midi_ports);
-		if (err < 0)
-			break;
-
-		base_offset += stream_count * EXT_APP_STREAM_ENTRY_SIZE;
-		stream_count = be32_to_cpu(reg[1]);
-		err = read_stream_entries(dice, section_addr, base_offset,
-					  stream_count,
-					  mode, dice->rx_pcm_chs,
-					  dice->rx_midi_ports);
-		if (err < 0)
-			break;
+		entry = buf + EXT_APP_STREAM_ENTRIES;
+		for (i = 0; i < tx_count; ++i) {
+			parse_stream_entry(entry, &dice->tx_pcm_chs[i][mode],
+					   &dice->tx_midi_ports[i],
+					   dice->tx_channel_names[i][mode]);
+			entry += EXT_APP_STREAM_ENTRY_SIZE;
+		}
+		for (i = 0; i < rx_count; ++i) {
+			parse_stream_entry(entry, &dice->rx_pcm_chs[i][mode],
+					   &dice->rx_midi_ports[i],
+					   dice->rx_channel_names[i][mode]);
+			entry += EXT_APP_STREAM_ENTRY_SIZE;
+		}
 	}
 
+	kfree(buf);
+
 	return err;
 }
 
@@ -144,13 +316,14 @@ int snd_dice_detect_extension_formats(struct snd_dice *dice)
 	u64 section_addr;
 	int err;
 
-	pointers = kmalloc_array(9, sizeof(__be32) * 2, GFP_KERNEL);
+	pointers = kmalloc_array(SND_DICE_EXT_SECTION_COUNT, sizeof(__be32) * 2,
+				 GFP_KERNEL);
 	if (pointers == NULL)
 		return -ENOMEM;
 
 	err = snd_fw_transaction(dice->unit, TCODE_READ_BLOCK_REQUEST,
 				 DICE_EXT_APP_SPACE, pointers,
-				 9 * sizeof(__be32) * 2, 0);
+				 SND_DICE_EXT_SECTION_COUNT * sizeof(__be32) * 2, 0);
 	if (err < 0)
 		goto end;
 
@@ -167,8 +340,16 @@ int snd_dice_detect_extension_formats(struct snd_dice *dice)
 		}
 	}
 
-	section_addr = DICE_EXT_APP_SPACE + be32_to_cpu(pointers[12]) * 4;
+	for (i = 0; i < SND_DICE_EXT_SECTION_COUNT; ++i) {
+		dice->ext_sections[i].offset = be32_to_cpu(pointers[i * 2]) * 4;
+		dice->ext_sections[i].size = be32_to_cpu(pointers[i * 2 + 1]) * 4;
+	}
+
+	section_addr = DICE_EXT_APP_SPACE +
+		       dice->ext_sections[SND_DICE_EXT_SECTION_CURRENT].offset;
 	err = detect_stream_formats(dice, section_addr);
+	if (err < 0)
+		memset(dice->ext_sections, 0, sizeof(dice->ext_sections));
 end:
 	kfree(pointers);
 	return err;
@@ -17,32 +17,42 @@ static long hwdep_read(struct snd_hwdep *hwdep, char __user *buf,
 
 	spin_lock_irq(&dice->lock);
 
-	while (!dice->dev_lock_changed && dice->notification_bits == 0) {
+	while (true) {
+		memset(&event, 0, sizeof(event));
+		if (atomic_xchg(&dice->dev_lock_changed, 0)) {
+			event.lock_status.type = SNDRV_FIREWIRE_EVENT_LOCK_STATUS;
+			event.lock_status.status =
+					atomic_read(&dice->dev_lock_count) > 0;
+
+			count = min_t(long, count, sizeof(event.lock_status));
+			break;
+		}
+
+		if (dice->notification_bits != 0) {
+			event.dice_notification.type =
+					SNDRV_FIREWIRE_EVENT_DICE_NOTIFICATION;
+			event.dice_notification.notification =
+					dice->notification_bits;
+			dice->notification_bits = 0;
+
+			count = min_t(long, count,
+				      sizeof(event.dice_notification));
+			break;
+		}
+
+		// The event can be taken by the other reader after wake up,
+		// then wait again.
 		prepare_to_wait(&dice->hwdep_wait, &wait, TASK_INTERRUPTIBLE);
 		spin_unlock_irq(&dice->lock);
-		schedule();
+		// The change of lock status is not serialized by the spinlock.
+		if (!atomic_read(&dice->dev_lock_changed))
+			schedule();
 		finish_wait(&dice->hwdep_wait, &wait);
 		if (signal_pending(current))
 			return -ERESTARTSYS;
 		spin_lock_irq(&dice->lock);
 	}
 
-	memset(&event, 0, sizeof(event));
-	if (dice->dev_lock_changed) {
-		event.lock_status.type = SNDRV_FIREWIRE_EVENT_LOCK_STATUS;
-		event.lock_status.status = dice->dev_lock_count > 0;
-		dice->dev_lock_changed = false;
-
-		count = min_t(long, count, sizeof(event.lock_status));
-	} else {
-		event.dice_notification.type =
-					SNDRV_FIREWIRE_EVENT_DICE_NOTIFICATION;
-		event.dice_notification.notification = dice->notification_bits;
-		dice->notification_bits = 0;
-
-		count = min_t(long, count, sizeof(event.dice_notification));
-	}
-
 	spin_unlock_irq(&dice->lock);
 
 	if (copy_to_user(buf, &event, count))
@@ -60,7 +70,8 @@ static __poll_t hwdep_poll(struct snd_hwdep *hwdep, struct file *file,
 	poll_wait(file, &dice->hwdep_wait, wait);
 
 	spin_lock_irq(&dice->lock);
-	if (dice->dev_lock_changed || dice->notification_bits != 0)
+	if (atomic_read(&dice->dev_lock_changed) ||
+	    dice->notification_bits != 0)
 		events = EPOLLIN | EPOLLRDNORM;
 	else
 		events = 0;
@@ -88,50 +99,56 @@ static int hwdep_get_info(struct snd_dice *dice, void __user *arg)
 	return 0;
 }
 
-static int hwdep_lock(struct snd_dice *dice)
+static int hwdep_get_clock_stats(struct snd_dice *dice, void __user *arg)
 {
-	int err;
+	struct snd_firewire_dice_clock_stats stats;
 
 	spin_lock_irq(&dice->lock);
+	stats = dice->clock_stats;
+	spin_unlock_irq(&dice->lock);
 
-	if (dice->dev_lock_count == 0) {
-		dice->dev_lock_count = -1;
-		err = 0;
-	} else {
-		err = -EBUSY;
-	}
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
 
-	spin_unlock_irq(&dice->lock);
+	return 0;
+}
+
+static int hwdep_get_drift(struct snd_dice *dice, void __user *arg)
+{
+	struct snd_firewire_dice_drift estimate;
 
-	return err;
+	snd_dice_pcm_get_drift(dice, &estimate);
+
+	if (copy_to_user(arg, &estimate, sizeof(estimate)))
+		return -EFAULT;
+
+	return 0;
 }
 
-static int hwdep_unlock(struct snd_dice *dice)
+static int hwdep_lock(struct snd_dice *dice)
 {
-	int err;
+	if (atomic_cmpxchg(&dice->dev_lock_count, 0, -1) != 0)
+		return -EBUSY;
 
-	spin_lock_irq(&dice->lock);
+	return 0;
+}
 
-	if (dice->dev_lock_count == -1) {
-		dice->dev_lock_count = 0;
-		err = 0;
-	} else {
-		err = -EBADFD;
-	}
+static int hwdep_unlock(struct snd_dice *dice)
+{
+	if (atomic_cmpxchg(&dice->dev_lock_count, -1, 0) != -1)
+		return -EBADFD;
 
-	spin_unlock_irq(&dice->lock);
+	snd_dice_stream_retry_detection(dice);
 
-	return err;
+	return 0;
 }
 
 static int hwdep_release(struct snd_hwdep *hwdep, struct file *file)
 {
 	struct snd_dice *dice = hwdep->private_data;
 
-	spin_lock_irq(&dice->lock);
-	if (dice->dev_lock_count == -1)
-		dice->dev_lock_count = 0;
-	spin_unlock_irq(&dice->lock);
+	if (atomic_cmpxchg(&dice->dev_lock_count, -1, 0) == -1)
+		snd_dice_stream_retry_detection(dice);
 
 	return 0;
 }
@@ -148,6 +165,14 @@ static int hwdep_ioctl(struct snd_hwdep *hwdep, struct file *file,
 		return hwdep_lock(dice);
 	case SNDRV_FIREWIRE_IOCTL_UNLOCK:
 		return hwdep_unlock(dice);
+	case SNDRV_FIREWIRE_IOCTL_DICE_GET_CLOCK_STATS:
+		return hwdep_get_clock_stats(dice, (void __user *)arg);
+	case SNDRV_FIREWIRE_IOCTL_DICE_GET_DRIFT:
+		return hwdep_get_drift(dice, (void __user *)arg);
+	case SNDRV_FIREWIRE_IOCTL_DICE_READ_CONFIG:
+		return snd_dice_router_read_config(dice, (void __user *)arg);
+	case SNDRV_FIREWIRE_IOCTL_DICE_WRITE_CONFIG:
+		return snd_dice_router_write_config(dice, (void __user *)arg);
 	default:
 		return -ENOIOCTLCMD;
 	}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0
+// dice-meter.c - a part of driver for DICE based devices
+//
+// Peak meters in the protocol extension, polled by one worker and published to
+// any number of consumers via a ring of frames mapped by the second hwdep
+// device. The device is not exclusive and has just mmap operation, thus it is
+// independent of the first hwdep device for the lock and notifications.
+
+#include <linux/vmalloc.h>
+
+#include "dice.h"
+
+static unsigned int meter_interval_ms = 50;
+module_param(meter_interval_ms, uint, 0644);
+MODULE_PARM_DESC(meter_interval_ms, "Interval to poll peak meters while the ring of meters is mapped, in milliseconds (default: 50)");
+
+#define METER_MIN_INTERVAL_MS	5
+#define METER_RING_FRAMES	64
+#define METER_MAX_PEAK_SIZE	4096
+
+static unsigned int get_peak_size(struct snd_dice *dice)
+{
+	return min_t(unsigned int,
+		     dice->ext_sections[SND_DICE_EXT_SECTION_PEAK].size,
+		     METER_MAX_PEAK_SIZE);
+}
+
+static void meter_work(struct work_struct *work)
+{
+	struct snd_dice *dice =
+		container_of(to_delayed_work(work), struct snd_dice, meter_work);
+	struct snd_firewire_dice_meter_ring *ring = dice->meter_ring;
+	unsigned int peak_size = get_peak_size(dice);
+	struct snd_firewire_dice_meter_frame *frame;
+	u32 position = ring->position;
+	unsigned int i;
+
+	// The last mapping was released.
+	if (atomic_read(&dice->meter_users) == 0)
+		return;
+
+	frame = (struct snd_firewire_dice_meter_frame *)(ring->frames +
+			(position % ring->frame_count) * ring->frame_size);
+
+	if (snd_dice_extension_read(dice, SND_DICE_EXT_SECTION_PEAK, 0,
+				    frame->peaks, peak_size) >= 0) {
+		for (i = 0; i < peak_size / 4; ++i)
+			be32_to_cpus(&frame->peaks[i]);
+		frame->tstamp = ktime_get_ns();
+		frame->sequence = position;
+		frame->peak_count = peak_size / 4;
+
+		// Publish the frame after it is filled.
+		smp_wmb();
+		WRITE_ONCE(ring->position, position + 1);
+	}
+
+	schedule_delayed_work(&dice->meter_work,
+		msecs_to_jiffies(max(meter_interval_ms, METER_MIN_INTERVAL_MS)));
+}
+
+// The callbacks run with the lock of memory map, thus the mutex of driver is
+// not used to avoid inversion against copy_{from,to}_user() under the mutex.
+static void meter_vm_open(struct vm_area_struct *vma)
+{
+	struct snd_dice *dice = vma->vm_private_data;
+
+	if (atomic_inc_return(&dice->meter_users) == 1)
+		schedule_delayed_work(&dice->meter_work, 0);
+}
+
+static void meter_vm_close(struct vm_area_struct *vma)
+{
+	struct snd_dice *dice = vma->vm_private_data;
+
+	// The worker stops by itself.
+	atomic_dec(&dice->meter_users);
+}
+
+static const struct vm_operations_struct meter_vm_ops = {
+	.open	= meter_vm_open,
+	.close	= meter_vm_close,
+};
+
+static int meter_mmap(struct snd_hwdep *hwdep, struct file *file,
+		      struct vm_area_struct *vma)
+{
+	struct snd_dice *dice = hwdep->private_data;
+	int err;
+
+	if (!dice->meter_ring)
+		return -ENXIO;
+
+	// Userspace can not make the ring writable by mprotect(2) later.
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	err = remap_vmalloc_range(vma, dice->meter_ring, vma->vm_pgoff);
+	if (err < 0)
+		return err;
+
+	vma->vm_ops = &meter_vm_ops;
+	vma->vm_private_data = dice;
+	meter_vm_open(vma);
+
+	return 0;
+}
+
+int snd_dice_create_meter(struct snd_dice *dice)
+{
+	static const struct snd_hwdep_ops ops = {
+		.mmap	= meter_mmap,
+	};
+	struct snd_firewire_dice_meter_ring *ring;
+	struct snd_hwdep *hwdep;
+	unsigned int frame_size;
+	unsigned int size;
+	int err;
+
+	if (get_peak_size(dice) == 0)
+		return 0;
+
+	err = snd_hwdep_new(dice->card, "DICE meter", 1, &hwdep);
+	if (err < 0)
+		return err;
+	strcpy(hwdep->name, "DICE meter");
+	hwdep->iface = SNDRV_HWDEP_IFACE_FW_DICE;
+	hwdep->ops = ops;
+	hwdep->private_data = dice;
+
+	frame_size = ALIGN(sizeof(struct snd_firewire_dice_meter_frame) +
+			   get_peak_size(dice), 8);
+	size = PAGE_ALIGN(sizeof(*ring) + frame_size * METER_RING_FRAMES);
+
+	ring = vmalloc_user(size);
+	if (!ring)
+		return -ENOMEM;
+	ring->frame_count = METER_RING_FRAMES;
+	ring->frame_size = frame_size;
+
+	INIT_DELAYED_WORK(&dice->meter_work, meter_work);
+	dice->meter_ring = ring;
+
+	return 0;
+}
+
+void snd_dice_destroy_meter(struct snd_dice *dice)
+{
+	if (!dice->meter_ring)
+		return;
+
+	cancel_delayed_work_sync(&dice->meter_work);
+	vfree(dice->meter_ring);
+	dice->meter_ring = NULL;
+}
@@ -48,38 +48,54 @@ static int midi_close(struct snd_rawmidi_substream *substream)
 	return 0;
 }
 
+// MIDI substreams are numbered in order of the stream carrying the port.
+static struct amdtp_stream *get_midi_stream(struct amdtp_stream *streams,
+					    const unsigned int *midi_ports,
+					    unsigned int *port)
+{
+	int i;
+
+	for (i = 0; i < MAX_STREAMS; ++i) {
+		if (*port < midi_ports[i])
+			return streams + i;
+		*port -= midi_ports[i];
+	}
+
+	return NULL;
+}
+
 static void midi_capture_trigger(struct snd_rawmidi_substream *substrm, int up)
 {
 	struct snd_dice *dice = substrm->rmidi->private_data;
-	unsigned long flags;
+	struct amdtp_stream *stream;
+	unsigned int port = substrm->number;
 
-	spin_lock_irqsave(&dice->lock, flags);
+	stream = get_midi_stream(dice->tx_stream, dice->tx_midi_ports, &port);
+	if (!stream)
+		return;
 
+	// The pointer to substream is swapped atomically, thus no lock is
+	// required against packet processing.
 	if (up)
-		amdtp_am824_midi_trigger(&dice->tx_stream[0],
-					  substrm->number, substrm);
+		amdtp_am824_midi_trigger(stream, port, substrm);
 	else
-		amdtp_am824_midi_trigger(&dice->tx_stream[0],
-					  substrm->number, NULL);
-
-	spin_unlock_irqrestore(&dice->lock, flags);
+		amdtp_am824_midi_trigger(stream, port, NULL);
 }
 
 static void midi_playback_trigger(struct snd_rawmidi_substream *substrm, int up)
 {
 	struct snd_dice *dice = substrm->rmidi->private_data;
-	unsigned long flags;
+	struct amdtp_stream *stream;
+	unsigned int port = substrm->number;
 
-	spin_lock_irqsave(&dice->lock, flags);
+	stream = get_midi_stream(dice->rx_stream, dice->rx_midi_ports, &port);
+	if (!stream)
+		return;
 
 	if (up)
-		amdtp_am824_midi_trigger(&dice->rx_stream[0],
-					 substrm->number, substrm);
+		amdtp_am824_midi_trigger(stream, port, substrm);
 	else
-		amdtp_am824_midi_trigger(&dice->rx_stream[0],
-					 substrm->number, NULL);
-
-	spin_unlock_irqrestore(&dice->lock, flags);
+		amdtp_am824_midi_trigger(stream, port, NULL);
 }
 
 static void set_midi_substream_names(struct snd_dice *dice,
@@ -114,8 +130,8 @@ int snd_dice_create_midi(struct snd_dice *dice)
 	midi_in_ports = 0;
 	midi_out_ports = 0;
 	for (i = 0; i < MAX_STREAMS; ++i) {
-		midi_in_ports = max(midi_in_ports, dice->tx_midi_ports[i]);
-		midi_out_ports = max(midi_out_ports, dice->rx_midi_ports[i]);
+		midi_in_ports += dice->tx_midi_ports[i];
+		midi_out_ports += dice->rx_midi_ports[i];
 	}
 
 	if (midi_in_ports + midi_out_ports == 0)
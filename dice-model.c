@@ -0,0 +1,398 @@
+// SPDX-License-Identifier: GPL-2.0
+// dice-model.c - a part of driver for DICE based devices
+//
+// Copyright (c) 2018 Takashi Sakamoto
+// Copyright (c) 2018 Melvin Vermeeren
+// Copyright (c) 2023 Rolf Anderegg and Michele Perrone
+//
+// Database of models with quirks or with stream formats known in advance. The
+// entry is looked up once in probe by the vendor and model ID of the unit and
+// by the version of firmware. The stream formats of model with tables are
+// applied without any transaction.
+
+#include <linux/firmware.h>
+
+#include "dice.h"
+
+#define MIDI_PORTS_FIRST	{1, 0}
+
+static const struct snd_dice_model models[] = {
+	// Avid M-Box 3 Pro.
+	// Below models are compliant to IEC 61883-1/6 and have no quirk at high
+	// sampling transfer frequency.
+	{
+		.vendor_id	= OUI_AVID,
+		.model_id	= 0x000004,
+		.detect_formats	= snd_dice_detect_extension_formats,
+		.quirks		= SND_DICE_QUIRK_NO_DOUBLE_PCM_FRAMES,
+	},
+	// M-Audio Profire 2626.
+	{
+		.vendor_id	= OUI_MAUDIO,
+		.model_id	= 0x000010,
+		.detect_formats	= snd_dice_detect_extension_formats,
+		.quirks		= SND_DICE_QUIRK_NO_DOUBLE_PCM_FRAMES,
+	},
+	// M-Audio Profire 610.
+	{
+		.vendor_id	= OUI_MAUDIO,
+		.model_id	= 0x000011,
+		.detect_formats	= snd_dice_detect_extension_formats,
+		.quirks		= SND_DICE_QUIRK_NO_DOUBLE_PCM_FRAMES,
+	},
+	// TC Electronic Konnekt 24D.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000020,
+		.tx_pcm_chs	= {{16, 16, 6}, {0, 0, 0} },
+		.rx_pcm_chs	= {{16, 16, 6}, {0, 0, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// TC Electronic Konnekt 8.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000021,
+		.tx_pcm_chs	= {{4, 4, 3}, {0, 0, 0} },
+		.rx_pcm_chs	= {{4, 4, 3}, {0, 0, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// TC Electronic Studio Konnekt 48.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000022,
+		.tx_pcm_chs	= {{16, 16, 8}, {16, 16, 7} },
+		.rx_pcm_chs	= {{16, 16, 8}, {14, 14, 7} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// TC Electronic Konnekt Live.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000023,
+		.tx_pcm_chs	= {{16, 16, 6}, {0, 0, 0} },
+		.rx_pcm_chs	= {{16, 16, 6}, {0, 0, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// TC Electronic Desktop Konnekt 6.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000024,
+		.tx_pcm_chs	= {{6, 6, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{6, 6, 4}, {0, 0, 0} },
+	},
+	// TC Electronic Impact Twin.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000027,
+		.tx_pcm_chs	= {{14, 10, 6}, {0, 0, 0} },
+		.rx_pcm_chs	= {{14, 10, 6}, {0, 0, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// TC Electronic Digital Konnekt x32.
+	{
+		.vendor_id	= OUI_TCELECTRONIC,
+		.model_id	= 0x000030,
+		.tx_pcm_chs	= {{16, 16, 4}, {0, 0, 0} },
+		.rx_pcm_chs	= {{16, 16, 4}, {0, 0, 0} },
+	},
+	// Alesis iO14/iO26. The model is distinguished by the number of
+	// channels in its tx stream.
+	{
+		.vendor_id	= OUI_ALESIS,
+		.model_id	= MODEL_ALESIS_IO_BOTH,
+		.detect_formats	= snd_dice_detect_alesis_formats,
+	},
+	// Alesis MasterControl.
+	{
+		.vendor_id	= OUI_ALESIS,
+		.model_id	= 0x000002,
+		.detect_formats	= snd_dice_detect_alesis_mastercontrol_formats,
+	},
+	// Mytek Stereo 192 DSD-DAC.
+	// Mytek has a few other firewire-capable devices, though newer models
+	// appear to lack the port more often than not. An example is the Mytek
+	// 8x192 ADDA, which is DICE.
+	{
+		.vendor_id	= OUI_MYTEK,
+		.model_id	= 0x000002,
+		// AES, TOSLINK, SPDIF, ADAT inputs on device.
+		.tx_pcm_chs	= {{8, 8, 8}, {0, 0, 0} },
+		// PCM 44.1-192, native DSD64/DSD128 to device.
+		.rx_pcm_chs	= {{4, 4, 4}, {0, 0, 0} },
+	},
+	// Presonus FireStudio.
+	{
+		.vendor_id	= OUI_PRESONUS,
+		.model_id	= 0x000008,
+		.tx_pcm_chs	= {{16, 16, 0}, {10, 2, 0} },
+		.rx_pcm_chs	= {{16, 16, 0}, {10, 2, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// Lexicon I-ONYX FW810S, up to 96.0 kHz.
+	{
+		.vendor_id	= OUI_HARMAN,
+		.model_id	= 0x000001,
+		.tx_pcm_chs	= {{12, 12, 0}, {0, 0, 0} },
+		.rx_pcm_chs	= {{10, 10, 0}, {0, 0, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// Focusrite Saffire Pro 40 with TCD3070-CH. Focusrite shipped several
+	// variants of Saffire Pro 40. One of them is based on TCD3070-CH apart
+	// from the others with TCD2220. It doesn't support TCAT protocol
+	// extension.
+	{
+		.vendor_id	= OUI_FOCUSRITE,
+		.model_id	= 0x0000de,
+		.tx_pcm_chs	= {{20, 16, 0}, {0, 0, 0} },
+		.rx_pcm_chs	= {{20, 16, 0}, {0, 0, 0} },
+		.tx_midi_ports	= MIDI_PORTS_FIRST,
+		.rx_midi_ports	= MIDI_PORTS_FIRST,
+	},
+	// Weiss DAC202: 192kHz 2-channel DAC.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000007,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss DAC202 Maya edition: same audio I/O as DAC202.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000008,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss MAN301: 192kHz 2-channel music archive network player.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x00000b,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss INT202: 192kHz unidirectional 2-channel digital Firewire
+	// interface.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000006,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{0, 0, 0}, {0, 0, 0} },
+	},
+	// Weiss INT203: 192kHz bidirectional 2-channel digital Firewire
+	// interface.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x00000a,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss ADC2: 192kHz A/D converter with microphone preamps and line
+	// inputs.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000001,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss DAC2/Minerva: 192kHz 2-channel DAC.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000003,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss Vesta: 192kHz 2-channel Firewire to AES/EBU interface.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000002,
+		.tx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+		.rx_pcm_chs	= {{2, 2, 2}, {0, 0, 0} },
+	},
+	// Weiss AFI1: 192kHz 24-channel Firewire to ADAT or AES/EBU interface.
+	{
+		.vendor_id	= OUI_WEISS,
+		.model_id	= 0x000004,
+		.tx_pcm_chs	= {{24, 16, 8}, {0, 0, 0} },
+		.rx_pcm_chs	= {{24, 16, 8}, {0, 0, 0} },
+	},
+};
+
+// The layout of firmware blob, 'dice/models.bin', to add or override entries
+// at runtime. The fields of entry are in the same order as the built-in table
+// and in little endian, without padding. The blob is read at each probe and
+// each reload of stream formats, thus a new blob is applied without rebuild of
+// module.
+#define MODEL_BLOB_NAME		"dice/models.bin"
+// 'DMDL' in little endian.
+#define MODEL_BLOB_MAGIC	0x4c444d44
+
+struct model_blob_entry {
+	__le32 vendor_id;
+	__le32 model_id;
+	__le32 min_version;
+	__le32 max_version;
+	__le32 tx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	__le32 rx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	__le32 tx_midi_ports[MAX_STREAMS];
+	__le32 rx_midi_ports[MAX_STREAMS];
+	__le32 tx_latency[SND_DICE_RATE_MODE_COUNT];
+	__le32 rx_latency[SND_DICE_RATE_MODE_COUNT];
+	__le32 quirks;
+};
+
+struct model_blob {
+	__le32 magic;
+	__le32 count;
+	struct model_blob_entry entries[];
+};
+
+static bool match_version(const struct snd_dice_model *model, u32 version)
+{
+	if (model->min_version != 0 && version < model->min_version)
+		return false;
+	if (model->max_version != 0 && version > model->max_version)
+		return false;
+	return true;
+}
+
+static void copy_le32(unsigned int *dst, const __le32 *src, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		dst[i] = le32_to_cpu(src[i]);
+}
+
+static void decode_blob_entry(struct snd_dice_model *model,
+			      const struct model_blob_entry *entry)
+{
+	memset(model, 0, sizeof(*model));
+	model->vendor_id = le32_to_cpu(entry->vendor_id);
+	model->model_id = le32_to_cpu(entry->model_id);
+	model->min_version = le32_to_cpu(entry->min_version);
+	model->max_version = le32_to_cpu(entry->max_version);
+	copy_le32(&model->tx_pcm_chs[0][0], &entry->tx_pcm_chs[0][0],
+		  MAX_STREAMS * SND_DICE_RATE_MODE_COUNT);
+	copy_le32(&model->rx_pcm_chs[0][0], &entry->rx_pcm_chs[0][0],
+		  MAX_STREAMS * SND_DICE_RATE_MODE_COUNT);
+	copy_le32(model->tx_midi_ports, entry->tx_midi_ports, MAX_STREAMS);
+	copy_le32(model->rx_midi_ports, entry->rx_midi_ports, MAX_STREAMS);
+	copy_le32(model->tx_latency, entry->tx_latency,
+		  SND_DICE_RATE_MODE_COUNT);
+	copy_le32(model->rx_latency, entry->rx_latency,
+		  SND_DICE_RATE_MODE_COUNT);
+	model->quirks = le32_to_cpu(entry->quirks);
+}
+
+// The first entry matching the unit is used, as well as the built-in table.
+static bool load_blob_entry(struct snd_dice *dice, struct snd_dice_model *model)
+{
+	const struct firmware *fw;
+	const struct model_blob *blob;
+	unsigned int i, count;
+	bool found = false;
+
+	if (request_firmware_direct(&fw, MODEL_BLOB_NAME, &dice->unit->device) < 0)
+		return false;
+
+	if (fw->size < sizeof(*blob))
+		goto end;
+	blob = (const struct model_blob *)fw->data;
+	count = le32_to_cpu(blob->count);
+	if (le32_to_cpu(blob->magic) != MODEL_BLOB_MAGIC ||
+	    fw->size != struct_size(blob, entries, count)) {
+		dev_warn(&dice->unit->device, "invalid %s\n", MODEL_BLOB_NAME);
+		goto end;
+	}
+
+	for (i = 0; i < count; ++i) {
+		decode_blob_entry(model, &blob->entries[i]);
+		if (model->vendor_id == dice->vendor_id &&
+		    model->model_id == dice->model_id &&
+		    match_version(model, dice->global_version)) {
+			found = true;
+			break;
+		}
+	}
+end:
+	release_firmware(fw);
+	return found;
+}
+
+// The entry in firmware blob is preferred to the built-in one.
+const struct snd_dice_model *snd_dice_model_lookup(struct snd_dice *dice)
+{
+	const struct snd_dice_model *model;
+	unsigned int i;
+
+	if (load_blob_entry(dice, &dice->model_override)) {
+		dice->model_overridden = true;
+		return &dice->model_override;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(models); ++i) {
+		model = &models[i];
+		if (model->vendor_id == dice->vendor_id &&
+		    model->model_id == dice->model_id &&
+		    match_version(model, dice->global_version))
+			return model;
+	}
+
+	return NULL;
+}
+
+int snd_dice_model_detect_formats(struct snd_dice *dice,
+				  const struct snd_dice_model *model)
+{
+	if (model->detect_formats)
+		return model->detect_formats(dice);
+
+	memcpy(dice->tx_pcm_chs, model->tx_pcm_chs, sizeof(dice->tx_pcm_chs));
+	memcpy(dice->rx_pcm_chs, model->rx_pcm_chs, sizeof(dice->rx_pcm_chs));
+	memcpy(dice->tx_midi_ports, model->tx_midi_ports,
+	       sizeof(dice->tx_midi_ports));
+	memcpy(dice->rx_midi_ports, model->rx_midi_ports,
+	       sizeof(dice->rx_midi_ports));
+	memcpy(dice->tx_converter_latency, model->tx_latency,
+	       sizeof(dice->tx_converter_latency));
+	memcpy(dice->rx_converter_latency, model->rx_latency,
+	       sizeof(dice->rx_converter_latency));
+
+	return 0;
+}
+
+// Called at reload of stream formats with the formats read from registers. The
+// entry in firmware blob is applied again, to follow the blob replaced after
+// probe. MIDI ports and quirks are kept since they are fixed at probe.
+void snd_dice_model_reload_formats(struct snd_dice *dice, bool *changed)
+{
+	struct snd_dice_model *model;
+
+	model = kmalloc(sizeof(*model), GFP_KERNEL);
+	if (!model)
+		return;
+
+	if (load_blob_entry(dice, model)) {
+		if (memcmp(dice->tx_pcm_chs, model->tx_pcm_chs,
+			   sizeof(dice->tx_pcm_chs)) ||
+		    memcmp(dice->rx_pcm_chs, model->rx_pcm_chs,
+			   sizeof(dice->rx_pcm_chs)))
+			*changed = true;
+
+		memcpy(dice->tx_pcm_chs, model->tx_pcm_chs,
+		       sizeof(dice->tx_pcm_chs));
+		memcpy(dice->rx_pcm_chs, model->rx_pcm_chs,
+		       sizeof(dice->rx_pcm_chs));
+		memcpy(dice->tx_converter_latency, model->tx_latency,
+		       sizeof(dice->tx_converter_latency));
+		memcpy(dice->rx_converter_latency, model->rx_latency,
+		       sizeof(dice->rx_converter_latency));
+	}
+
+	kfree(model);
+}
@@ -8,6 +8,16 @@
 
 #include "dice.h"
 
+// In low-latency profile, the hardware IRQ interval and the queue of packets
+// are kept small.
+#define LOW_LATENCY_MAX_PERIOD_USEC	1000
+#define LOW_LATENCY_MAX_PERIODS		3
+
+static bool pcm_pointer_interpolation;
+module_param(pcm_pointer_interpolation, bool, 0644);
+MODULE_PARM_DESC(pcm_pointer_interpolation,
+		 "Estimate PCM position between processed packets (default: false)");
+
 static int dice_rate_constraint(struct snd_pcm_hw_params *params,
 				struct snd_pcm_hw_rule *rule)
 {
@@ -158,7 +168,16 @@ static int init_hw_info(struct snd_dice *dice,
 	if (err < 0)
 		return err;
 
-	return amdtp_am824_add_pcm_hw_constraints(stream, runtime);
+	err = amdtp_am824_add_pcm_hw_constraints(stream, runtime);
+	if (err < 0)
+		return err;
+
+	// The queued packets are processed in pointer and ack callbacks as well,
+	// thus applications can drive the substream by timer without period
+	// wakeup.
+	hw->info |= SNDRV_PCM_INFO_NO_PERIOD_WAKEUP;
+
+	return 0;
 }
 
 static int pcm_open(struct snd_pcm_substream *substream)
@@ -202,7 +221,7 @@ static int pcm_open(struct snd_pcm_substream *substream)
 	// transmission of PCM frames, the available sampling rate is limited
 	// at current one.
 	if (!internal ||
-	    (dice->substreams_counter > 0 && d->events_per_period > 0)) {
+	    (dice->substreams_counter > 0 && !dice->midi_only)) {
 		unsigned int frames_per_period = d->events_per_period;
 		unsigned int frames_per_buffer = d->events_per_buffer;
 		unsigned int rate;
@@ -216,7 +235,9 @@ static int pcm_open(struct snd_pcm_substream *substream)
 		substream->runtime->hw.rate_min = rate;
 		substream->runtime->hw.rate_max = rate;
 
-		if (frames_per_period > 0) {
+		// The interval of session just for MIDI substreams is not for
+		// PCM substreams.
+		if (frames_per_period > 0 && !dice->midi_only) {
 			// For double_pcm_frame quirk.
 			if (rate > 96000 && !dice->disable_double_pcm_frames) {
 				frames_per_period *= 2;
@@ -243,6 +264,22 @@ static int pcm_open(struct snd_pcm_substream *substream)
 
 	mutex_unlock(&dice->mutex);
 
+	// The period and buffer are already aligned to the data blocks in a
+	// packet by the constraints of AM824 stream.
+	if (dice->low_latency) {
+		err = snd_pcm_hw_constraint_minmax(substream->runtime,
+					SNDRV_PCM_HW_PARAM_PERIOD_TIME,
+					0, LOW_LATENCY_MAX_PERIOD_USEC);
+		if (err < 0)
+			goto err_locked;
+
+		err = snd_pcm_hw_constraint_minmax(substream->runtime,
+					SNDRV_PCM_HW_PARAM_PERIODS,
+					2, LOW_LATENCY_MAX_PERIODS);
+		if (err < 0)
+			goto err_locked;
+	}
+
 	snd_pcm_set_sync(substream);
 
 	return 0;
@@ -277,6 +314,15 @@ static int pcm_hw_params(struct snd_pcm_substream *substream,
 			events_per_period /= 2;
 			events_per_buffer /= 2;
 		}
+		// Without period wakeup, hardware IRQ is just required to keep
+		// the isochronous contexts serviced, since the packets are
+		// processed on demand in pointer and ack callbacks. A half of
+		// buffer is enough for the interval unless in low-latency
+		// profile.
+		if (!dice->low_latency &&
+		    (hw_params->flags & SNDRV_PCM_HW_PARAMS_NO_PERIOD_WAKEUP))
+			events_per_period = max(events_per_period,
+						events_per_buffer / 2);
 		err = snd_dice_stream_reserve_duplex(dice, rate,
 					events_per_period, events_per_buffer);
 		if (err >= 0)
@@ -303,6 +349,46 @@ static int pcm_hw_free(struct snd_pcm_substream *substream)
 	return 0;
 }
 
+// The unit can change the formats of streams, or follow the new rate of external
+// source of clock, after the hardware parameters are decided. The substream
+// should be closed and opened again in the case, since the constraints of
+// channels and rate are decided at open and kept till close.
+static int check_pcm_params(struct snd_pcm_substream *substream)
+{
+	struct snd_dice *dice = substream->private_data;
+	unsigned int index = substream->pcm->device;
+	unsigned int *pcm_channels;
+	unsigned int *converter_latency;
+	enum snd_dice_rate_mode mode;
+	unsigned int rate;
+	int err;
+
+	err = snd_dice_transaction_get_rate(dice, &rate);
+	if (err < 0)
+		return err;
+	err = snd_dice_stream_get_rate_mode(dice, rate, &mode);
+	if (err < 0)
+		return err;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		pcm_channels = dice->tx_pcm_chs[index];
+		converter_latency = dice->tx_converter_latency;
+	} else {
+		pcm_channels = dice->rx_pcm_chs[index];
+		converter_latency = dice->rx_converter_latency;
+	}
+
+	if (substream->runtime->rate != rate ||
+	    substream->runtime->channels != pcm_channels[mode])
+		return -EBADFD;
+
+	// The latency of converters in the unit is reported as extra delay if
+	// known by the database of models, else zero.
+	substream->runtime->delay = converter_latency[mode];
+
+	return 0;
+}
+
 static int capture_prepare(struct snd_pcm_substream *substream)
 {
 	struct snd_dice *dice = substream->private_data;
@@ -310,12 +396,14 @@ static int capture_prepare(struct snd_pcm_substream *substream)
 	int err;
 
 	mutex_lock(&dice->mutex);
-	err = snd_dice_stream_start_duplex(dice);
+	err = check_pcm_params(substream);
+	if (err >= 0)
+		err = snd_dice_stream_start_duplex(dice);
 	mutex_unlock(&dice->mutex);
 	if (err >= 0)
 		amdtp_stream_pcm_prepare(stream);
 
-	return 0;
+	return err;
 }
 static int playback_prepare(struct snd_pcm_substream *substream)
 {
@@ -324,7 +412,9 @@ static int playback_prepare(struct snd_pcm_substream *substream)
 	int err;
 
 	mutex_lock(&dice->mutex);
-	err = snd_dice_stream_start_duplex(dice);
+	err = check_pcm_params(substream);
+	if (err >= 0)
+		err = snd_dice_stream_start_duplex(dice);
 	mutex_unlock(&dice->mutex);
 	if (err >= 0)
 		amdtp_stream_pcm_prepare(stream);
@@ -332,35 +422,95 @@ static int playback_prepare(struct snd_pcm_substream *substream)
 	return err;
 }
 
-static int capture_trigger(struct snd_pcm_substream *substream, int cmd)
+static struct amdtp_stream *get_pcm_stream(struct snd_dice *dice,
+					   struct snd_pcm_substream *substream)
 {
-	struct snd_dice *dice = substream->private_data;
-	struct amdtp_stream *stream = &dice->tx_stream[substream->pcm->device];
+	unsigned int index = substream->pcm->device;
 
-	switch (cmd) {
-	case SNDRV_PCM_TRIGGER_START:
-		amdtp_stream_pcm_trigger(stream, substream);
-		break;
-	case SNDRV_PCM_TRIGGER_STOP:
-		amdtp_stream_pcm_trigger(stream, NULL);
-		break;
-	default:
-		return -EINVAL;
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		return &dice->tx_stream[index];
+	else
+		return &dice->rx_stream[index];
+}
+
+// The estimate of the former run is discarded since the substream can start
+// after long interval.
+static void start_drift(struct snd_dice *dice)
+{
+	struct snd_dice_drift *drift = &dice->drift;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dice->lock, flags);
+	drift->valid = false;
+	drift->running = true;
+	drift->last_polled = jiffies;
+	drift->measurements = 0;
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+static void stop_drift(struct snd_dice *dice)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dice->lock, flags);
+	dice->drift.running = false;
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+static void arm_substream(struct snd_dice *dice,
+			  struct snd_pcm_substream *substream)
+{
+	unsigned int index = substream->pcm->device;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		dice->tx_pcm_position[index].valid = false;
+		if (index == 0)
+			start_drift(dice);
+	} else {
+		dice->rx_pcm_position[index].valid = false;
 	}
 
-	return 0;
+	snd_dice_roundtrip_start(dice, substream);
+	amdtp_stream_pcm_trigger(get_pcm_stream(dice, substream), substream);
 }
-static int playback_trigger(struct snd_pcm_substream *substream, int cmd)
+
+// The streams are already running since preparation. The trigger of the first
+// substream in linked group arms the PCM transfer of all substreams of this unit
+// in the group at once, so that the packet processing starts the transfer in
+// the same isochronous cycle. The trigger of the rest is done already.
+static void arm_linked_substreams(struct snd_dice *dice,
+				  struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_substream *s;
+
+	if (READ_ONCE(get_pcm_stream(dice, substream)->pcm) == substream)
+		return;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if (s->private_data == dice)
+			arm_substream(dice, s);
+	}
+
+	dice->link_offset_valid = false;
+}
+
+static int pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct snd_dice *dice = substream->private_data;
-	struct amdtp_stream *stream = &dice->rx_stream[substream->pcm->device];
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		amdtp_stream_pcm_trigger(stream, substream);
+		if (snd_pcm_stream_linked(substream))
+			arm_linked_substreams(dice, substream);
+		else
+			arm_substream(dice, substream);
 		break;
 	case SNDRV_PCM_TRIGGER_STOP:
-		amdtp_stream_pcm_trigger(stream, NULL);
+		amdtp_stream_pcm_trigger(get_pcm_stream(dice, substream), NULL);
+		if (substream->stream == SNDRV_PCM_STREAM_CAPTURE &&
+		    substream->pcm->device == 0)
+			stop_drift(dice);
+		snd_dice_roundtrip_stop(dice, substream);
 		break;
 	default:
 		return -EINVAL;
@@ -369,19 +519,322 @@ static int playback_trigger(struct snd_pcm_substream *substream, int cmd)
 	return 0;
 }
 
+static int get_cycle_ticks(struct snd_dice *dice, u32 *ticks)
+{
+	struct fw_card *card = fw_parent_device(dice->unit)->card;
+	u32 cycle_time;
+	int err;
+
+	err = fw_card_read_cycle_time(card, &cycle_time);
+	if (err < 0)
+		return err;
+
+	*ticks = ((cycle_time >> 25) * SND_DICE_CYCLES_PER_SECOND +
+		  ((cycle_time >> 12) & 0x1fff)) * SND_DICE_TICKS_PER_CYCLE +
+		 (cycle_time & 0xfff);
+
+	return 0;
+}
+
+// The position returned by amdtp_domain_stream_pcm_pointer() advances in steps
+// of processed packets. The anchor moves to the processed position whenever it
+// advances, then the position is estimated forward from the anchor by the
+// elapsed time of 1394 cycle timer and the nominal rate. The estimated advance
+// is less than the frames in one packet, thus it never overtakes the processed
+// position at the next step.
+static snd_pcm_uframes_t interpolate_pointer(struct snd_dice *dice,
+					     struct snd_pcm_substream *substream,
+					     struct amdtp_stream *stream,
+					     struct snd_dice_pcm_position *pos,
+					     snd_pcm_uframes_t processed)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned int frames_per_packet;
+	u32 ticks, elapsed;
+	u64 frames;
+
+	if (processed == SNDRV_PCM_POS_XRUN)
+		return processed;
+
+	if (get_cycle_ticks(dice, &ticks) < 0)
+		return processed;
+
+	if (!pos->valid || pos->anchor != processed) {
+		pos->anchor = processed;
+		pos->anchor_ticks = ticks;
+		pos->valid = true;
+		return processed;
+	}
+
+	elapsed = ticks - pos->anchor_ticks;
+	if (ticks < pos->anchor_ticks)
+		elapsed += SND_DICE_TICKS_PER_WRAP;
+	frames = div_u64((u64)elapsed * runtime->rate,
+			 SND_DICE_TICKS_PER_SECOND);
+
+	// In blocking mode, one packet includes the events of SYT_INTERVAL. For
+	// double_pcm_frames quirk, one event includes two PCM frames.
+	frames_per_packet = stream->syt_interval;
+	if (runtime->rate > 96000 && !dice->disable_double_pcm_frames)
+		frames_per_packet *= 2;
+	if (frames >= frames_per_packet)
+		frames = frames_per_packet - 1;
+
+	return (processed + frames) % runtime->buffer_size;
+}
+
+// The processed position advances in steps of packets and is observed when
+// the application queries it, thus each observation has error of a packet and
+// of the scheduling. The deviation is estimated by the slope of least-squares
+// line fitted to the observations over a span of ten seconds, then the
+// estimates of spans are smoothed by exponential moving average.
+#define DRIFT_SPAN_TICKS	(10 * SND_DICE_TICKS_PER_SECOND)
+#define DRIFT_SAMPLE_TICKS	(SND_DICE_TICKS_PER_SECOND / 100)
+#define DRIFT_MAX_INTERVAL_TICKS	SND_DICE_TICKS_PER_SECOND
+#define DRIFT_MIN_SAMPLES	100
+// The observation is in units of 1/100 frames against 2048 ticks, in which the
+// sums for the fit never overflow within the span.
+#define DRIFT_X_SHIFT		11
+#define DRIFT_R_SCALE		100
+#define DRIFT_MAX_RESIDUAL	(4096 * DRIFT_R_SCALE)
+#define DRIFT_AVERAGE_SHIFT	3
+#define DRIFT_MAX_PPB		1000000	// 1000 ppm.
+#define DRIFT_STALE_MS		2000
+
+static void start_span(struct snd_dice_drift *drift,
+		       snd_pcm_uframes_t processed, u32 ticks)
+{
+	drift->last = processed;
+	drift->last_ticks = ticks;
+	drift->frames = 0;
+	drift->elapsed = 0;
+	drift->sampled = 0;
+	drift->count = 1;
+	drift->sum_x = 0;
+	drift->sum_xx = 0;
+	drift->sum_r = 0;
+	drift->sum_xr = 0;
+	drift->valid = true;
+}
+
+// The residual of processed frames against the frames at nominal rate.
+static bool add_observation(struct snd_dice_drift *drift)
+{
+	s64 x = drift->elapsed >> DRIFT_X_SHIFT;
+	s64 r;
+
+	r = (s64)drift->frames * DRIFT_R_SCALE -
+	    (s64)div_u64((u64)drift->elapsed * drift->rate * DRIFT_R_SCALE,
+			 SND_DICE_TICKS_PER_SECOND);
+	if (abs(r) > DRIFT_MAX_RESIDUAL)
+		return false;
+
+	drift->sum_x += x;
+	drift->sum_xx += x * x;
+	drift->sum_r += r;
+	drift->sum_xr += x * r;
+	++drift->count;
+	drift->sampled = drift->elapsed;
+
+	return true;
+}
+
+static void fit_span(struct snd_dice_drift *drift)
+{
+	s64 n = drift->count;
+	s64 num, den, ppb;
+
+	if (n < DRIFT_MIN_SAMPLES)
+		return;
+
+	num = n * drift->sum_xr - drift->sum_x * drift->sum_r;
+	den = n * drift->sum_xx - drift->sum_x * drift->sum_x;
+	// The slope more than two is far beyond the maximum deviation.
+	if (den <= 0 || abs(num) > 2 * den)
+		return;
+
+	// The slope in 1/100 frames per 2048 ticks to parts per billion.
+	ppb = div_u64(mul_u64_u64_div_u64(abs(num),
+			(u64)SND_DICE_TICKS_PER_SECOND * NSEC_PER_SEC /
+			(DRIFT_R_SCALE << DRIFT_X_SHIFT), den),
+		      drift->rate);
+	if (num < 0)
+		ppb = -ppb;
+	if (abs(ppb) > DRIFT_MAX_PPB)
+		return;
+
+	if (drift->measurements++ == 0) {
+		drift->ppb = ppb;
+		drift->jitter_ppb = 0;
+	} else {
+		drift->jitter_ppb += div_s64(abs(ppb - drift->ppb) -
+					     (s64)drift->jitter_ppb,
+					     1 << DRIFT_AVERAGE_SHIFT);
+		drift->ppb += div_s64(ppb - drift->ppb,
+				      1 << DRIFT_AVERAGE_SHIFT);
+	}
+}
+
+static void measure_drift(struct snd_dice *dice,
+			  struct snd_pcm_substream *substream,
+			  snd_pcm_uframes_t processed)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_dice_drift *drift = &dice->drift;
+	unsigned long flags;
+	u32 ticks, interval = 0;
+
+	if (processed == SNDRV_PCM_POS_XRUN)
+		return;
+	if (get_cycle_ticks(dice, &ticks) < 0)
+		return;
+
+	spin_lock_irqsave(&dice->lock, flags);
+
+	drift->last_polled = jiffies;
+
+	if (drift->rate != runtime->rate) {
+		drift->rate = runtime->rate;
+		drift->measurements = 0;
+		drift->valid = false;
+	}
+
+	// The processed position can wrap around the buffer between queries
+	// with long interval.
+	if (drift->valid) {
+		interval = ticks - drift->last_ticks;
+		if (ticks < drift->last_ticks)
+			interval += SND_DICE_TICKS_PER_WRAP;
+		if (interval >= DRIFT_MAX_INTERVAL_TICKS ||
+		    (u64)interval * drift->rate >=
+		    (u64)SND_DICE_TICKS_PER_SECOND *
+		    (runtime->buffer_size - runtime->buffer_size / 4))
+			drift->valid = false;
+	}
+
+	if (!drift->valid) {
+		start_span(drift, processed, ticks);
+		goto end;
+	}
+
+	drift->frames += (processed + runtime->buffer_size - drift->last) %
+			 runtime->buffer_size;
+	drift->last = processed;
+	drift->last_ticks = ticks;
+	drift->elapsed += interval;
+
+	// The observation with larger residual is discontinuity, such as
+	// skipped packets.
+	if (drift->elapsed - drift->sampled >= DRIFT_SAMPLE_TICKS &&
+	    !add_observation(drift)) {
+		drift->valid = false;
+		goto end;
+	}
+
+	if (drift->elapsed >= DRIFT_SPAN_TICKS) {
+		fit_span(drift);
+		start_span(drift, processed, ticks);
+	}
+end:
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+// The estimate is not reported when the position of the first capture PCM
+// substream is not queried any more, since it can be stale.
+void snd_dice_pcm_get_drift(struct snd_dice *dice,
+			    struct snd_firewire_dice_drift *estimate)
+{
+	struct snd_dice_drift *drift = &dice->drift;
+
+	memset(estimate, 0, sizeof(*estimate));
+
+	spin_lock_irq(&dice->lock);
+	if (!drift->running) {
+		estimate->state = SNDRV_FIREWIRE_DICE_DRIFT_NOT_RUNNING;
+	} else if (time_after(jiffies, drift->last_polled +
+					msecs_to_jiffies(DRIFT_STALE_MS))) {
+		estimate->state = SNDRV_FIREWIRE_DICE_DRIFT_NOT_POLLED;
+	} else if (drift->measurements == 0) {
+		estimate->state = SNDRV_FIREWIRE_DICE_DRIFT_MEASURING;
+	} else {
+		estimate->state = SNDRV_FIREWIRE_DICE_DRIFT_VALID;
+		estimate->rate = drift->rate;
+		estimate->measurements = drift->measurements;
+		estimate->ppb = drift->ppb;
+		estimate->jitter_ppb = drift->jitter_ppb;
+	}
+	spin_unlock_irq(&dice->lock);
+}
+
+// For substream of the other tx stream linked to the substream of the first tx
+// stream, the offset of frames between them is measured once both of them
+// transfer frames. A positive offset means that the substream started later.
+static void measure_link_offset(struct snd_dice *dice,
+				struct snd_pcm_substream *substream,
+				snd_pcm_uframes_t processed)
+{
+	snd_pcm_uframes_t buffer_size = substream->runtime->buffer_size;
+	struct snd_pcm_substream *s, *first = NULL;
+	snd_pcm_uframes_t first_processed;
+	long offset;
+
+	if (dice->link_offset_valid || !snd_pcm_stream_linked(substream) ||
+	    processed == 0 || processed == SNDRV_PCM_POS_XRUN)
+		return;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if (s == READ_ONCE(dice->tx_stream[0].pcm))
+			first = s;
+	}
+	if (!first || first->runtime->buffer_size != buffer_size)
+		return;
+
+	first_processed = amdtp_domain_stream_pcm_pointer(&dice->domain,
+							  &dice->tx_stream[0]);
+	if (first_processed == 0 || first_processed == SNDRV_PCM_POS_XRUN)
+		return;
+
+	offset = (first_processed + buffer_size - processed) % buffer_size;
+	if (offset > buffer_size / 2)
+		offset -= buffer_size;
+
+	dice->link_offset = offset;
+	dice->link_offset_valid = true;
+}
+
 static snd_pcm_uframes_t capture_pointer(struct snd_pcm_substream *substream)
 {
 	struct snd_dice *dice = substream->private_data;
-	struct amdtp_stream *stream = &dice->tx_stream[substream->pcm->device];
+	unsigned int index = substream->pcm->device;
+	struct amdtp_stream *stream = &dice->tx_stream[index];
+	snd_pcm_uframes_t pos;
+
+	pos = amdtp_domain_stream_pcm_pointer(&dice->domain, stream);
+	if (index == 0)
+		measure_drift(dice, substream, pos);
+	else
+		measure_link_offset(dice, substream, pos);
+	snd_dice_roundtrip_capture(dice, substream, pos);
+	if (pcm_pointer_interpolation)
+		pos = interpolate_pointer(dice, substream, stream,
+					  &dice->tx_pcm_position[index], pos);
 
-	return amdtp_domain_stream_pcm_pointer(&dice->domain, stream);
+	return pos;
 }
 static snd_pcm_uframes_t playback_pointer(struct snd_pcm_substream *substream)
 {
 	struct snd_dice *dice = substream->private_data;
-	struct amdtp_stream *stream = &dice->rx_stream[substream->pcm->device];
+	unsigned int index = substream->pcm->device;
+	struct amdtp_stream *stream = &dice->rx_stream[index];
+	snd_pcm_uframes_t pos;
+
+	pos = amdtp_domain_stream_pcm_pointer(&dice->domain, stream);
+	snd_dice_roundtrip_playback(dice, substream, pos);
+	if (pcm_pointer_interpolation)
+		pos = interpolate_pointer(dice, substream, stream,
+					  &dice->rx_pcm_position[index], pos);
 
-	return amdtp_domain_stream_pcm_pointer(&dice->domain, stream);
+	return pos;
 }
 
 static int capture_ack(struct snd_pcm_substream *substream)
@@ -408,7 +861,7 @@ int snd_dice_create_pcm(struct snd_dice *dice)
 		.hw_params = pcm_hw_params,
 		.hw_free   = pcm_hw_free,
 		.prepare   = capture_prepare,
-		.trigger   = capture_trigger,
+		.trigger   = pcm_trigger,
 		.pointer   = capture_pointer,
 		.ack       = capture_ack,
 	};
@@ -418,7 +871,7 @@ int snd_dice_create_pcm(struct snd_dice *dice)
 		.hw_params = pcm_hw_params,
 		.hw_free   = pcm_hw_free,
 		.prepare   = playback_prepare,
-		.trigger   = playback_trigger,
+		.trigger   = pcm_trigger,
 		.pointer   = playback_pointer,
 		.ack       = playback_ack,
 	};
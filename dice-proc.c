@@ -253,6 +253,10 @@ static void dice_proc_read_formation(struct snd_info_entry *entry,
 	struct snd_dice *dice = entry->private_data;
 	int i, j;
 
+	// To check whether the cache of formats is restored at probe.
+	snd_iprintf(buffer, "source: %s\n",
+		    dice->formats_cached ? "cache" : "detection");
+
 	snd_iprintf(buffer, "Output stream from unit:\n");
 	for (i = 0; i < SND_DICE_RATE_MODE_COUNT; ++i)
 		snd_iprintf(buffer, "\t%s", rate_labels[i]);
@@ -274,6 +278,156 @@ static void dice_proc_read_formation(struct snd_info_entry *entry,
 			snd_iprintf(buffer, "\t%u", dice->rx_pcm_chs[i][j]);
 		snd_iprintf(buffer, "\t%u\n", dice->rx_midi_ports[i]);
 	}
+
+	// Available just for units with the protocol extension.
+	for (i = 0; i < MAX_STREAMS; ++i) {
+		for (j = 0; j < SND_DICE_RATE_MODE_COUNT; ++j) {
+			if (dice->tx_channel_names[i][j][0] != '\0')
+				snd_iprintf(buffer, "Tx %u %s names: %s\n",
+					    i, rate_labels[j],
+					    dice->tx_channel_names[i][j]);
+		}
+	}
+	for (i = 0; i < MAX_STREAMS; ++i) {
+		for (j = 0; j < SND_DICE_RATE_MODE_COUNT; ++j) {
+			if (dice->rx_channel_names[i][j][0] != '\0')
+				snd_iprintf(buffer, "Rx %u %s names: %s\n",
+					    i, rate_labels[j],
+					    dice->rx_channel_names[i][j]);
+		}
+	}
+}
+
+static unsigned int frames_to_usec(unsigned int frames, unsigned int rate)
+{
+	return div_u64((u64)frames * USEC_PER_SEC, rate);
+}
+
+static void dice_proc_read_latency(struct snd_info_entry *entry,
+				   struct snd_info_buffer *buffer)
+{
+	struct snd_dice *dice = entry->private_data;
+	unsigned int events_per_period, events_per_buffer;
+	unsigned int rate, frames_per_event;
+	unsigned int period, queue, transfer_delay, round_trip;
+	unsigned int da, ad;
+	enum snd_dice_rate_mode mode;
+
+	if (snd_dice_transaction_get_rate(dice, &rate) < 0)
+		return;
+	if (snd_dice_stream_get_rate_mode(dice, rate, &mode) < 0)
+		return;
+
+	mutex_lock(&dice->mutex);
+	if (dice->substreams_counter > 0 && !dice->midi_only) {
+		events_per_period = dice->domain.events_per_period;
+		events_per_buffer = dice->domain.events_per_buffer;
+	} else {
+		events_per_period = 0;
+		events_per_buffer = 0;
+	}
+	mutex_unlock(&dice->mutex);
+
+	snd_iprintf(buffer, "profile: %s\n",
+		    dice->low_latency ? "low-latency" : "default");
+	snd_iprintf(buffer, "rate: %u\n", rate);
+	if (events_per_period == 0) {
+		snd_iprintf(buffer, "PCM substreams: not reserved\n");
+		return;
+	}
+
+	// For double_pcm_frame quirk.
+	if (rate > 96000 && !dice->disable_double_pcm_frames)
+		frames_per_event = 2;
+	else
+		frames_per_event = 1;
+
+	period = events_per_period * frames_per_event;
+	queue = events_per_buffer * frames_per_event;
+	transfer_delay = DIV_ROUND_UP(SND_DICE_TRANSFER_DELAY_TICKS * rate,
+				      SND_DICE_TICKS_PER_SECOND);
+
+	// The frames are queued for the whole buffer of playback substream,
+	// delivered to the unit after transfer delay, then captured frames are
+	// delivered to the application at the next period.
+	round_trip = queue + transfer_delay + period;
+
+	snd_iprintf(buffer, "period: %u frames (%u usec)\n",
+		    period, frames_to_usec(period, rate));
+	snd_iprintf(buffer, "queue: %u frames (%u usec)\n",
+		    queue, frames_to_usec(queue, rate));
+	snd_iprintf(buffer, "transfer delay: %u frames (%u usec)\n",
+		    transfer_delay, frames_to_usec(transfer_delay, rate));
+
+	// The latency of converters in the unit is known just for the models
+	// with the figures in the database of models.
+	da = dice->rx_converter_latency[mode];
+	ad = dice->tx_converter_latency[mode];
+	if (da == 0 || ad == 0) {
+		snd_iprintf(buffer, "conversion: unknown\n");
+		snd_iprintf(buffer, "estimated round trip: %u frames (%u usec), excluding conversion\n",
+			    round_trip, frames_to_usec(round_trip, rate));
+	} else {
+		round_trip += da + ad;
+		snd_iprintf(buffer, "D/A conversion: %u frames (%u usec)\n",
+			    da, frames_to_usec(da, rate));
+		snd_iprintf(buffer, "A/D conversion: %u frames (%u usec)\n",
+			    ad, frames_to_usec(ad, rate));
+		snd_iprintf(buffer, "estimated round trip: %u frames (%u usec)\n",
+			    round_trip, frames_to_usec(round_trip, rate));
+	}
+	if (dice->link_offset_valid)
+		snd_iprintf(buffer, "linked capture offset: %d frames\n",
+			    dice->link_offset);
+}
+
+static void dice_proc_read_clock(struct snd_info_entry *entry,
+				 struct snd_info_buffer *buffer)
+{
+	static const char *const sources[SND_DICE_EXT_SOURCE_COUNT] = {
+		"aes1", "aes2", "aes3", "aes4", "adat", "tdif",
+		"arx1", "arx2", "arx3", "arx4", "wc"
+	};
+	struct snd_dice *dice = entry->private_data;
+	struct snd_firewire_dice_clock_stats stats;
+	struct snd_firewire_dice_drift drift;
+	u32 ext_status;
+	unsigned int i;
+
+	spin_lock_irq(&dice->lock);
+	ext_status = dice->global_shadow.ext_status;
+	stats = dice->clock_stats;
+	spin_unlock_irq(&dice->lock);
+
+	snd_iprintf(buffer, "source\tlocked\tslips\tlast slip\tunlocks\tlast unlock\n");
+	for (i = 0; i < SND_DICE_EXT_SOURCE_COUNT; ++i) {
+		struct snd_firewire_dice_clock_source_stats *s = &stats.sources[i];
+
+		snd_iprintf(buffer, "%s\t%u\t%u\t%llu\t%u\t%llu\n",
+			    sources[i], !!(ext_status & BIT(i)),
+			    s->slips, s->last_slip_ns,
+			    s->unlocks, s->last_unlock_ns);
+	}
+
+	// Measured only while the first capture PCM substream runs and its
+	// position is queried.
+	snd_dice_pcm_get_drift(dice, &drift);
+	switch (drift.state) {
+	case SNDRV_FIREWIRE_DICE_DRIFT_VALID:
+		snd_iprintf(buffer, "drift: %lld ppb at %u, jitter %llu ppb, %u measurements\n",
+			    drift.ppb, drift.rate, drift.jitter_ppb,
+			    drift.measurements);
+		break;
+	case SNDRV_FIREWIRE_DICE_DRIFT_NOT_RUNNING:
+		snd_iprintf(buffer, "drift: invalid (capture PCM substream 0 not running)\n");
+		break;
+	case SNDRV_FIREWIRE_DICE_DRIFT_MEASURING:
+		snd_iprintf(buffer, "drift: invalid (measuring)\n");
+		break;
+	default:
+		snd_iprintf(buffer, "drift: invalid (position of capture PCM substream 0 not queried)\n");
+		break;
+	}
 }
 
 static void add_node(struct snd_dice *dice, struct snd_info_entry *root,
@@ -304,4 +458,8 @@ void snd_dice_create_proc(struct snd_dice *dice)
 
 	add_node(dice, root, "dice", dice_proc_read);
 	add_node(dice, root, "formation", dice_proc_read_formation);
+	add_node(dice, root, "latency", dice_proc_read_latency);
+	add_node(dice, root, "clock", dice_proc_read_clock);
+
+	snd_dice_create_roundtrip(dice, root);
 }
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0
+// dice-roundtrip.c - a part of driver for DICE based devices
+//
+// Measurement of round-trip latency. A marker sample is injected to a channel
+// of playback substream, and detected in a channel of capture substream looped
+// back outside of the unit. The latency is the distance of frames between them,
+// counted from the start of PCM transfer. The playback and capture substreams
+// should be linked so that they start at the same isochronous cycle, else the
+// measurement is invalid.
+
+#include "dice.h"
+
+// Full scale in the most significant 24 bits.
+#define ROUNDTRIP_MARKER	0x7fffff00
+// The analog filters of converters smear the marker.
+#define ROUNDTRIP_THRESHOLD	0x20000000
+// The minimum frames between the positions of hardware and application to
+// inject.
+#define ROUNDTRIP_MIN_MARGIN	16
+
+// The frames are counted by the distance of processed positions between
+// queries, thus the count loses the whole buffer when the position wraps
+// around between them, e.g. when the application queries lazily or uses no
+// period wakeup. The counter stops when the interval of queries reaches 3/4 of
+// the buffer, to leave margin for the packets processed in bursts.
+static bool count_frames(struct snd_dice_roundtrip_counter *counter,
+			 struct snd_pcm_runtime *runtime,
+			 snd_pcm_uframes_t processed)
+{
+	u64 now = ktime_get_ns();
+	u64 limit_ns;
+
+	limit_ns = div_u64((u64)(runtime->buffer_size - runtime->buffer_size / 4) *
+			   NSEC_PER_SEC, runtime->rate);
+	if (now - counter->last_ns >= limit_ns) {
+		counter->running = false;
+		return false;
+	}
+
+	counter->frames += (processed + runtime->buffer_size - counter->last) %
+			   runtime->buffer_size;
+	counter->last = processed;
+	counter->last_ns = now;
+
+	return true;
+}
+
+static void add_result(struct snd_dice_roundtrip *rt, int latency)
+{
+	struct snd_dice_roundtrip_result *result = NULL;
+	unsigned int i;
+
+	for (i = 0; i < rt->result_count; ++i) {
+		if (rt->results[i].rate == rt->rate &&
+		    rt->results[i].period_size == rt->period_size) {
+			result = &rt->results[i];
+			break;
+		}
+	}
+
+	// The oldest one is replaced.
+	if (!result) {
+		unsigned int count = rt->result_count;
+
+		if (count < SND_DICE_ROUNDTRIP_RESULTS)
+			rt->result_count = ++count;
+		else
+			memmove(rt->results, rt->results + 1,
+				sizeof(rt->results[0]) * (count - 1));
+		result = &rt->results[count - 1];
+	}
+
+	result->rate = rt->rate;
+	result->period_size = rt->period_size;
+	result->latency = latency;
+}
+
+// The measurement is aborted and recorded as invalid.
+static void abort_measurement(struct snd_dice_roundtrip *rt,
+			      struct snd_pcm_runtime *runtime)
+{
+	if (rt->state == SND_DICE_ROUNDTRIP_IDLE)
+		return;
+
+	rt->rate = runtime->rate;
+	rt->period_size = runtime->period_size;
+	add_result(rt, SND_DICE_ROUNDTRIP_INVALID);
+	rt->state = SND_DICE_ROUNDTRIP_IDLE;
+}
+
+// The substreams in linked group are started by one trigger.
+static bool is_pair_linked(struct snd_dice *dice,
+			   struct snd_pcm_substream *substream)
+{
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	struct snd_pcm_substream *s;
+	unsigned int index;
+	int stream;
+
+	if (!snd_pcm_stream_linked(substream))
+		return false;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		stream = SNDRV_PCM_STREAM_CAPTURE;
+		index = rt->tx_stream;
+	} else {
+		stream = SNDRV_PCM_STREAM_PLAYBACK;
+		index = rt->rx_stream;
+	}
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if (s->private_data == dice && s->stream == stream &&
+		    s->pcm->device == index)
+			return true;
+	}
+
+	return false;
+}
+
+static void reset_counter(struct snd_dice_roundtrip_counter *counter,
+			  bool linked)
+{
+	counter->frames = 0;
+	counter->last = 0;
+	counter->last_ns = ktime_get_ns();
+	counter->running = true;
+	counter->linked = linked;
+}
+
+// Called when PCM transfer of the substream is armed.
+void snd_dice_roundtrip_start(struct snd_dice *dice,
+			      struct snd_pcm_substream *substream)
+{
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	unsigned int index = substream->pcm->device;
+	bool linked = is_pair_linked(dice, substream);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dice->lock, flags);
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK &&
+	    index == rt->rx_stream)
+		reset_counter(&rt->rx, linked);
+	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE &&
+		 index == rt->tx_stream)
+		reset_counter(&rt->tx, linked);
+
+	// The origin of counters is lost.
+	if (rt->state == SND_DICE_ROUNDTRIP_INJECTED)
+		rt->state = SND_DICE_ROUNDTRIP_ARMED;
+
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+void snd_dice_roundtrip_playback(struct snd_dice *dice,
+				 struct snd_pcm_substream *substream,
+				 snd_pcm_uframes_t processed)
+{
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	snd_pcm_uframes_t margin, pos;
+	unsigned long flags;
+
+	if (substream->pcm->device != rt->rx_stream ||
+	    processed == SNDRV_PCM_POS_XRUN)
+		return;
+
+	spin_lock_irqsave(&dice->lock, flags);
+
+	if (!rt->rx.running)
+		goto end;
+	if (!count_frames(&rt->rx, runtime, processed)) {
+		abort_measurement(rt, runtime);
+		goto end;
+	}
+
+	if (rt->state != SND_DICE_ROUNDTRIP_ARMED || !rt->tx.running ||
+	    rt->rx_channel >= runtime->channels)
+		goto end;
+
+	// The counters have no common origin.
+	if (!rt->rx.linked || !rt->tx.linked) {
+		abort_measurement(rt, runtime);
+		goto end;
+	}
+
+	// Inject at the middle of frames written by application and not
+	// processed yet, thus neither of them overwrites the marker.
+	margin = snd_pcm_playback_hw_avail(runtime) / 2;
+	if (margin < ROUNDTRIP_MIN_MARGIN)
+		goto end;
+	pos = (processed + margin) % runtime->buffer_size;
+
+	*(s32 *)(runtime->dma_area + frames_to_bytes(runtime, pos) +
+		 rt->rx_channel * sizeof(s32)) = ROUNDTRIP_MARKER;
+
+	rt->marker_frame = rt->rx.frames + margin;
+	rt->rate = runtime->rate;
+	rt->period_size = runtime->period_size;
+	rt->state = SND_DICE_ROUNDTRIP_INJECTED;
+end:
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+void snd_dice_roundtrip_capture(struct snd_dice *dice,
+				struct snd_pcm_substream *substream,
+				snd_pcm_uframes_t processed)
+{
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	snd_pcm_uframes_t pos;
+	unsigned long flags;
+	u64 frame;
+	s32 sample;
+
+	if (substream->pcm->device != rt->tx_stream ||
+	    processed == SNDRV_PCM_POS_XRUN)
+		return;
+
+	spin_lock_irqsave(&dice->lock, flags);
+
+	if (!rt->tx.running)
+		goto end;
+
+	pos = rt->tx.last;
+	frame = rt->tx.frames;
+	if (!count_frames(&rt->tx, runtime, processed)) {
+		abort_measurement(rt, runtime);
+		goto end;
+	}
+
+	if (rt->state != SND_DICE_ROUNDTRIP_INJECTED ||
+	    rt->tx_channel >= runtime->channels)
+		goto end;
+
+	// The marker never arrives before injected.
+	for (; frame < rt->tx.frames; ++frame, ++pos) {
+		if (frame < rt->marker_frame)
+			continue;
+
+		pos %= runtime->buffer_size;
+		sample = *(s32 *)(runtime->dma_area +
+				  frames_to_bytes(runtime, pos) +
+				  rt->tx_channel * sizeof(s32));
+		if (sample >= ROUNDTRIP_THRESHOLD ||
+		    sample <= -ROUNDTRIP_THRESHOLD) {
+			add_result(rt, frame - rt->marker_frame);
+			rt->state = SND_DICE_ROUNDTRIP_IDLE;
+			goto end;
+		}
+	}
+
+	// Give up after one second.
+	if (rt->tx.frames > rt->marker_frame + rt->rate) {
+		add_result(rt, SND_DICE_ROUNDTRIP_NOT_DETECTED);
+		rt->state = SND_DICE_ROUNDTRIP_IDLE;
+	}
+end:
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+// Called when PCM transfer of the substream is stopped.
+void snd_dice_roundtrip_stop(struct snd_dice *dice,
+			     struct snd_pcm_substream *substream)
+{
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	unsigned int index = substream->pcm->device;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dice->lock, flags);
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK &&
+	    index == rt->rx_stream)
+		rt->rx.running = false;
+	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE &&
+		 index == rt->tx_stream)
+		rt->tx.running = false;
+	spin_unlock_irqrestore(&dice->lock, flags);
+}
+
+static void roundtrip_read(struct snd_info_entry *entry,
+			   struct snd_info_buffer *buffer)
+{
+	static const char *const states[] = {
+		[SND_DICE_ROUNDTRIP_IDLE] = "idle",
+		[SND_DICE_ROUNDTRIP_ARMED] = "armed",
+		[SND_DICE_ROUNDTRIP_INJECTED] = "injected",
+	};
+	struct snd_dice *dice = entry->private_data;
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	struct snd_dice_roundtrip_result results[SND_DICE_ROUNDTRIP_RESULTS];
+	unsigned int rx_stream, rx_channel, tx_stream, tx_channel;
+	unsigned int state, count, i;
+
+	spin_lock_irq(&dice->lock);
+	rx_stream = rt->rx_stream;
+	rx_channel = rt->rx_channel;
+	tx_stream = rt->tx_stream;
+	tx_channel = rt->tx_channel;
+	state = rt->state;
+	count = rt->result_count;
+	memcpy(results, rt->results, sizeof(results));
+	spin_unlock_irq(&dice->lock);
+
+	snd_iprintf(buffer, "state: %s\n", states[state]);
+	snd_iprintf(buffer, "rx %u channel %u to tx %u channel %u\n",
+		    rx_stream, rx_channel, tx_stream, tx_channel);
+	for (i = 0; i < count; ++i) {
+		if (results[i].latency == SND_DICE_ROUNDTRIP_INVALID) {
+			snd_iprintf(buffer, "rate %u period %u: invalid\n",
+				    results[i].rate, results[i].period_size);
+		} else if (results[i].latency < 0) {
+			snd_iprintf(buffer, "rate %u period %u: not detected\n",
+				    results[i].rate, results[i].period_size);
+		} else {
+			snd_iprintf(buffer, "rate %u period %u: %d frames\n",
+				    results[i].rate, results[i].period_size,
+				    results[i].latency);
+		}
+	}
+}
+
+// Write '<rx stream> <rx channel> <tx stream> <tx channel>' to arm the
+// measurement.
+static void roundtrip_write(struct snd_info_entry *entry,
+			    struct snd_info_buffer *buffer)
+{
+	struct snd_dice *dice = entry->private_data;
+	struct snd_dice_roundtrip *rt = &dice->roundtrip;
+	unsigned int rx_stream, rx_channel, tx_stream, tx_channel;
+	char line[64];
+
+	if (snd_info_get_line(buffer, line, sizeof(line)))
+		return;
+	if (sscanf(line, "%u %u %u %u", &rx_stream, &rx_channel, &tx_stream,
+		   &tx_channel) != 4)
+		return;
+	if (rx_stream >= MAX_STREAMS || tx_stream >= MAX_STREAMS)
+		return;
+
+	spin_lock_irq(&dice->lock);
+	// The counters are for the former streams.
+	if (rx_stream != rt->rx_stream)
+		rt->rx.running = false;
+	if (tx_stream != rt->tx_stream)
+		rt->tx.running = false;
+	rt->rx_stream = rx_stream;
+	rt->rx_channel = rx_channel;
+	rt->tx_stream = tx_stream;
+	rt->tx_channel = tx_channel;
+	rt->state = SND_DICE_ROUNDTRIP_ARMED;
+	spin_unlock_irq(&dice->lock);
+}
+
+void snd_dice_create_roundtrip(struct snd_dice *dice,
+			       struct snd_info_entry *root)
+{
+	struct snd_info_entry *entry;
+
+	entry = snd_info_create_card_entry(dice->card, "roundtrip", root);
+	if (!entry)
+		return;
+
+	snd_info_set_text_ops(entry, dice, roundtrip_read);
+	entry->c.text.write = roundtrip_write;
+	entry->mode |= 0200;
+}
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0
+// dice-router.c - a part of driver for DICE based devices
+//
+// Upload of router and mixer configuration in the protocol extension by ioctls
+// of hwdep device. The whole section to write is compared to the content read
+// from the unit just before, then only the changed ranges are written to the
+// unit. The content is not cached since the unit can be configured by the
+// others, or be initialized by bus reset. The content of router section is
+// loaded by one command afterwards.
+
+#include "dice.h"
+
+// A gap of unchanged quadlets shorter than this is written together with the
+// changed ranges around it, since one more transaction costs more than a few
+// quadlets in payload.
+#define COALESCE_GAP_QUADLETS	8
+
+static int get_section(const struct snd_firewire_dice_config *config,
+		       enum snd_dice_ext_section *section)
+{
+	switch (config->section) {
+	case SNDRV_FIREWIRE_DICE_CONFIG_ROUTER:
+		*section = SND_DICE_EXT_SECTION_ROUTER;
+		return 0;
+	case SNDRV_FIREWIRE_DICE_CONFIG_MIXER:
+		*section = SND_DICE_EXT_SECTION_MIXER;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int write_changes(struct snd_dice *dice,
+			 enum snd_dice_ext_section section,
+			 const __be32 *curr, __be32 *desired,
+			 unsigned int quadlets)
+{
+	unsigned int i, j, last;
+	int err;
+
+	i = 0;
+	while (i < quadlets) {
+		if (curr[i] == desired[i]) {
+			++i;
+			continue;
+		}
+
+		last = i;
+		for (j = i + 1; j < quadlets && j - last <= COALESCE_GAP_QUADLETS; ++j) {
+			if (curr[j] != desired[j])
+				last = j;
+		}
+
+		err = snd_dice_extension_write(dice, section, i * 4,
+					       desired + i, (last - i + 1) * 4);
+		if (err < 0)
+			return err;
+
+		i = last + 1;
+	}
+
+	return 0;
+}
+
+static int apply_config(struct snd_dice *dice, enum snd_dice_ext_section section,
+			__be32 *desired, unsigned int size)
+{
+	enum snd_dice_rate_mode mode;
+	unsigned int rate;
+	__be32 *curr;
+	int err;
+
+	curr = kmalloc(size, GFP_KERNEL);
+	if (!curr)
+		return -ENOMEM;
+
+	err = snd_dice_extension_read(dice, section, 0, curr, size);
+	if (err >= 0)
+		err = write_changes(dice, section, curr, desired, size / 4);
+	kfree(curr);
+	if (err < 0)
+		return err;
+
+	// The coefficients of mixer are effective without any command.
+	if (section != SND_DICE_EXT_SECTION_ROUTER)
+		return 0;
+
+	err = snd_dice_transaction_get_rate(dice, &rate);
+	if (err < 0)
+		return err;
+	err = snd_dice_stream_get_rate_mode(dice, rate, &mode);
+	if (err < 0)
+		return err;
+
+	return snd_dice_extension_load_router(dice, mode);
+}
+
+// The size is updated with the size of section. The content is copied up to
+// the given size.
+int snd_dice_router_read_config(struct snd_dice *dice, void __user *arg)
+{
+	struct snd_firewire_dice_config config;
+	enum snd_dice_ext_section section;
+	unsigned int size;
+	__be32 *buf;
+	int err;
+
+	if (copy_from_user(&config, arg, sizeof(config)))
+		return -EFAULT;
+	err = get_section(&config, &section);
+	if (err < 0)
+		return err;
+
+	size = dice->ext_sections[section].size;
+	if (size == 0 || size % 4 != 0)
+		return -ENXIO;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&dice->mutex);
+	err = snd_dice_extension_read(dice, section, 0, buf, size);
+	mutex_unlock(&dice->mutex);
+	if (err < 0)
+		goto end;
+
+	if (copy_to_user(u64_to_user_ptr(config.data), buf,
+			 min(config.size, size))) {
+		err = -EFAULT;
+		goto end;
+	}
+
+	config.size = size;
+	if (copy_to_user(arg, &config, sizeof(config)))
+		err = -EFAULT;
+end:
+	kfree(buf);
+	return err;
+}
+
+// The whole section should be written at once.
+int snd_dice_router_write_config(struct snd_dice *dice, void __user *arg)
+{
+	struct snd_firewire_dice_config config;
+	enum snd_dice_ext_section section;
+	unsigned int size;
+	__be32 *desired;
+	int err;
+
+	if (copy_from_user(&config, arg, sizeof(config)))
+		return -EFAULT;
+	err = get_section(&config, &section);
+	if (err < 0)
+		return err;
+
+	size = dice->ext_sections[section].size;
+	if (size == 0 || size % 4 != 0)
+		return -ENXIO;
+	if (config.size != size)
+		return -EINVAL;
+
+	desired = memdup_user(u64_to_user_ptr(config.data), size);
+	if (IS_ERR(desired))
+		return PTR_ERR(desired);
+
+	mutex_lock(&dice->mutex);
+	err = apply_config(dice, section, desired, size);
+	mutex_unlock(&dice->mutex);
+
+	kfree(desired);
+
+	return err;
+}
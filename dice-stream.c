@@ -11,6 +11,15 @@
 #define	READY_TIMEOUT_MS	200
 #define NOTIFICATION_TIMEOUT_MS	100
 
+// The interval shorter than this results in the queue of a few packets, which
+// is likely to cause discontinuity of packets.
+#define MIDI_MIN_INTERVAL_USEC	1000
+#define MIDI_PERIODS_PER_BUFFER	4
+
+static unsigned int midi_interval_usec;
+module_param(midi_interval_usec, uint, 0644);
+MODULE_PARM_DESC(midi_interval_usec, "Interval of packet processing in session just for MIDI substreams, in microseconds. Shorter interval gives finer timestamp to incoming MIDI bytes, at least 1000 (default: 0 for 10 msec)");
+
 struct reg_params {
 	unsigned int count;
 	unsigned int size;
@@ -29,8 +38,8 @@ const unsigned int snd_dice_rates[SND_DICE_RATES_COUNT] = {
 	[6] = 192000,
 };
 
-int snd_dice_stream_get_rate_mode(struct snd_dice *dice, unsigned int rate,
-				  enum snd_dice_rate_mode *mode)
+static int get_rate_mode(unsigned int clock_caps, unsigned int rate,
+			 enum snd_dice_rate_mode *mode)
 {
 	/* Corresponding to each entry in snd_dice_rates. */
 	static const enum snd_dice_rate_mode modes[] = {
@@ -45,7 +54,7 @@ int snd_dice_stream_get_rate_mode(struct snd_dice *dice, unsigned int rate,
 	int i;
 
 	for (i = 0; i < ARRAY_SIZE(snd_dice_rates); i++) {
-		if (!(dice->clock_caps & BIT(i)))
+		if (!(clock_caps & BIT(i)))
 			continue;
 		if (snd_dice_rates[i] != rate)
 			continue;
@@ -57,6 +66,12 @@ int snd_dice_stream_get_rate_mode(struct snd_dice *dice, unsigned int rate,
 	return -EINVAL;
 }
 
+int snd_dice_stream_get_rate_mode(struct snd_dice *dice, unsigned int rate,
+				  enum snd_dice_rate_mode *mode)
+{
+	return get_rate_mode(dice->clock_caps, rate, mode);
+}
+
 static int select_clock(struct snd_dice *dice, unsigned int rate)
 {
 	__be32 reg, new;
@@ -122,6 +137,33 @@ static int get_register_params(struct snd_dice *dice,
 	return 0;
 }
 
+// When the session is reserved just for MIDI substreams, the streams up to the
+// last one carrying MIDI ports are enough to transfer MIDI messages.
+static unsigned int count_streams(struct snd_dice *dice,
+				  enum amdtp_stream_direction dir,
+				  struct reg_params *params)
+{
+	const unsigned int *midi_ports;
+	unsigned int count;
+	unsigned int i;
+
+	if (!dice->midi_only)
+		return params->count;
+
+	if (dir == AMDTP_IN_STREAM)
+		midi_ports = dice->tx_midi_ports;
+	else
+		midi_ports = dice->rx_midi_ports;
+
+	count = 1;
+	for (i = 1; i < MAX_STREAMS; ++i) {
+		if (midi_ports[i] > 0)
+			count = i + 1;
+	}
+
+	return min(count, params->count);
+}
+
 static void release_resources(struct snd_dice *dice)
 {
 	int i;
@@ -206,7 +248,7 @@ static int keep_dual_resources(struct snd_dice *dice, unsigned int rate,
 	if (err < 0)
 		return err;
 
-	for (i = 0; i < params->count; ++i) {
+	for (i = 0; i < count_streams(dice, dir, params); ++i) {
 		__be32 reg[2];
 		struct amdtp_stream *stream;
 		struct fw_iso_resources *resources;
@@ -266,6 +308,8 @@ int snd_dice_stream_reserve_duplex(struct snd_dice *dice, unsigned int rate,
 				   unsigned int events_per_period,
 				   unsigned int events_per_buffer)
 {
+	// MIDI substreams reserve the session without any period.
+	bool midi_only = (events_per_period == 0);
 	unsigned int curr_rate;
 	int err;
 
@@ -276,7 +320,10 @@ int snd_dice_stream_reserve_duplex(struct snd_dice *dice, unsigned int rate,
 	if (rate == 0)
 		rate = curr_rate;
 
-	if (dice->substreams_counter == 0 || curr_rate != rate) {
+	// The session just for MIDI substreams is expanded to all of streams
+	// when any PCM substream joins in it.
+	if (dice->substreams_counter == 0 || curr_rate != rate ||
+	    (dice->midi_only && !midi_only) || dice->params_stale) {
 		struct reg_params tx_params, rx_params;
 
 		amdtp_domain_stop(&dice->domain);
@@ -288,6 +335,8 @@ int snd_dice_stream_reserve_duplex(struct snd_dice *dice, unsigned int rate,
 
 		release_resources(dice);
 
+		dice->midi_only = midi_only;
+
 		// Just after owning the unit (GLOBAL_OWNER), the unit can
 		// return invalid stream formats. Selecting clock parameters
 		// have an effect for the unit to refine it.
@@ -311,10 +360,30 @@ int snd_dice_stream_reserve_duplex(struct snd_dice *dice, unsigned int rate,
 		if (err < 0)
 			goto error;
 
+		// The timestamp of incoming MIDI byte is taken when the packet
+		// is processed, thus the interval of processing determines its
+		// granularity.
+		if (midi_only && midi_interval_usec > 0) {
+			unsigned int events_per_second = rate;
+
+			// For double_pcm_frame quirk.
+			if (rate > 96000 && !dice->disable_double_pcm_frames)
+				events_per_second /= 2;
+
+			events_per_period = div_u64((u64)events_per_second *
+					max(midi_interval_usec,
+					    MIDI_MIN_INTERVAL_USEC),
+					USEC_PER_SEC);
+			events_per_buffer = events_per_period *
+					    MIDI_PERIODS_PER_BUFFER;
+		}
+
 		err = amdtp_domain_set_events_per_period(&dice->domain,
 					events_per_period, events_per_buffer);
 		if (err < 0)
 			goto error;
+
+		dice->params_stale = false;
 	}
 
 	return 0;
@@ -330,7 +399,7 @@ static int start_streams(struct snd_dice *dice, enum amdtp_stream_direction dir,
 	int i;
 	int err;
 
-	for (i = 0; i < params->count; i++) {
+	for (i = 0; i < count_streams(dice, dir, params); i++) {
 		struct amdtp_stream *stream;
 		struct fw_iso_resources *resources;
 		__be32 reg;
@@ -383,6 +452,7 @@ int snd_dice_stream_start_duplex(struct snd_dice *dice)
 {
 	unsigned int generation = dice->rx_resources[0].generation;
 	struct reg_params tx_params, rx_params;
+	unsigned int tx_count, rx_count;
 	unsigned int i;
 	unsigned int rate;
 	enum snd_dice_rate_mode mode;
@@ -391,6 +461,17 @@ int snd_dice_stream_start_duplex(struct snd_dice *dice)
 	if (dice->substreams_counter == 0)
 		return -EIO;
 
+	// Keep resources again for the formats changed by the unit.
+	if (dice->params_stale) {
+		struct amdtp_domain *d = &dice->domain;
+
+		err = snd_dice_stream_reserve_duplex(dice, 0,
+				dice->midi_only ? 0 : d->events_per_period,
+				d->events_per_buffer);
+		if (err < 0)
+			return err;
+	}
+
 	err = get_register_params(dice, &tx_params, &rx_params);
 	if (err < 0)
 		return err;
@@ -421,11 +502,13 @@ int snd_dice_stream_start_duplex(struct snd_dice *dice)
 	err = snd_dice_stream_get_rate_mode(dice, rate, &mode);
 	if (err < 0)
 		return err;
+	tx_count = count_streams(dice, AMDTP_IN_STREAM, &tx_params);
+	rx_count = count_streams(dice, AMDTP_OUT_STREAM, &rx_params);
 	for (i = 0; i < MAX_STREAMS; ++i) {
-		if (dice->tx_pcm_chs[i][mode] > 0 &&
+		if (i < tx_count && dice->tx_pcm_chs[i][mode] > 0 &&
 		    !amdtp_stream_running(&dice->tx_stream[i]))
 			break;
-		if (dice->rx_pcm_chs[i][mode] > 0 &&
+		if (i < rx_count && dice->rx_pcm_chs[i][mode] > 0 &&
 		    !amdtp_stream_running(&dice->rx_stream[i]))
 			break;
 	}
@@ -482,6 +565,9 @@ void snd_dice_stream_stop_duplex(struct snd_dice *dice)
 
 		amdtp_domain_stop(&dice->domain);
 		release_resources(dice);
+
+		if (dice->undetected_modes != 0)
+			schedule_work(&dice->detect_work);
 	}
 }
 
@@ -606,13 +692,131 @@ void snd_dice_stream_update_duplex(struct snd_dice *dice)
 	}
 }
 
+static int read_number_registers(struct snd_dice *dice,
+				 enum amdtp_stream_direction dir,
+				 struct reg_params *params, unsigned int index,
+				 __be32 *reg)
+{
+	if (dir == AMDTP_IN_STREAM) {
+		return snd_dice_transaction_read_tx(dice,
+				params->size * index + TX_NUMBER_AUDIO,
+				reg, sizeof(__be32) * 2);
+	} else {
+		return snd_dice_transaction_read_rx(dice,
+				params->size * index + RX_NUMBER_AUDIO,
+				reg, sizeof(__be32) * 2);
+	}
+}
+
+// Read the current formats of streams in the direction into the tables for the
+// mode. The number of MIDI ports is the maximum over modes.
+static int read_stream_formats(struct snd_dice *dice,
+			       enum amdtp_stream_direction dir,
+			       struct reg_params *params,
+			       enum snd_dice_rate_mode mode, bool *changed)
+{
+	unsigned int (*pcm_chs)[SND_DICE_RATE_MODE_COUNT];
+	unsigned int *midi_ports;
+	__be32 reg[2];
+	unsigned int i;
+	int err;
+
+	if (dir == AMDTP_IN_STREAM) {
+		pcm_chs = dice->tx_pcm_chs;
+		midi_ports = dice->tx_midi_ports;
+	} else {
+		pcm_chs = dice->rx_pcm_chs;
+		midi_ports = dice->rx_midi_ports;
+	}
+
+	for (i = 0; i < params->count; ++i) {
+		err = read_number_registers(dice, dir, params, i, reg);
+		if (err < 0)
+			return err;
+
+		if (changed && pcm_chs[i][mode] != be32_to_cpu(reg[0]))
+			*changed = true;
+
+		pcm_chs[i][mode] = be32_to_cpu(reg[0]);
+		midi_ports[i] = max_t(unsigned int, be32_to_cpu(reg[1]),
+				      midi_ports[i]);
+	}
+
+	return 0;
+}
+
+static int check_stream_formats(struct snd_dice *dice,
+				enum amdtp_stream_direction dir,
+				struct reg_params *params,
+				enum snd_dice_rate_mode mode,
+				const unsigned int (*pcm_chs)[SND_DICE_RATE_MODE_COUNT],
+				const unsigned int *midi_ports)
+{
+	unsigned int pcm, midi;
+	__be32 reg[2];
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < MAX_STREAMS; ++i) {
+		pcm = 0;
+		midi = 0;
+		if (i < params->count) {
+			err = read_number_registers(dice, dir, params, i, reg);
+			if (err < 0)
+				return err;
+			pcm = be32_to_cpu(reg[0]);
+			midi = be32_to_cpu(reg[1]);
+		}
+
+		if (pcm_chs[i][mode] != pcm || midi_ports[i] < midi)
+			return -ENODATA;
+	}
+
+	return 0;
+}
+
+// Compare the given tables with the formats of streams in the current mode. It
+// is quick enough to validate the cache of formats at probe, while the unit
+// can change the formats by the configuration of router or optical interface.
+// The mode is computed by the given capabilities of clock, since the ones of
+// the unit are not detected yet at probe.
+int snd_dice_stream_check_formats(struct snd_dice *dice,
+			unsigned int clock_caps,
+			const unsigned int (*tx_pcm_chs)[SND_DICE_RATE_MODE_COUNT],
+			const unsigned int (*rx_pcm_chs)[SND_DICE_RATE_MODE_COUNT],
+			const unsigned int *tx_midi_ports,
+			const unsigned int *rx_midi_ports)
+{
+	struct reg_params tx_params, rx_params;
+	enum snd_dice_rate_mode mode;
+	unsigned int rate;
+	int err;
+
+	err = snd_dice_transaction_get_rate(dice, &rate);
+	if (err < 0)
+		return err;
+	err = get_rate_mode(clock_caps, rate, &mode);
+	if (err < 0)
+		return err;
+	err = get_register_params(dice, &tx_params, &rx_params);
+	if (err < 0)
+		return err;
+
+	err = check_stream_formats(dice, AMDTP_IN_STREAM, &tx_params, mode,
+				   tx_pcm_chs, tx_midi_ports);
+	if (err < 0)
+		return err;
+
+	return check_stream_formats(dice, AMDTP_OUT_STREAM, &rx_params, mode,
+				    rx_pcm_chs, rx_midi_ports);
+}
+
 int snd_dice_stream_detect_current_formats(struct snd_dice *dice)
 {
 	unsigned int rate;
 	enum snd_dice_rate_mode mode;
-	__be32 reg[2];
 	struct reg_params tx_params, rx_params;
-	int i;
+	unsigned int i;
 	int err;
 
 	/* If extended protocol is available, detect detail spec. */
@@ -645,64 +849,278 @@ int snd_dice_stream_detect_current_formats(struct snd_dice *dice)
 	if (err < 0)
 		return err;
 
-	for (i = 0; i < tx_params.count; ++i) {
-		err = snd_dice_transaction_read_tx(dice,
-				tx_params.size * i + TX_NUMBER_AUDIO,
-				reg, sizeof(reg));
-		if (err < 0)
-			return err;
-		dice->tx_pcm_chs[i][mode] = be32_to_cpu(reg[0]);
-		dice->tx_midi_ports[i] = max_t(unsigned int,
-				be32_to_cpu(reg[1]), dice->tx_midi_ports[i]);
-	}
-	for (i = 0; i < rx_params.count; ++i) {
-		err = snd_dice_transaction_read_rx(dice,
-				rx_params.size * i + RX_NUMBER_AUDIO,
-				reg, sizeof(reg));
-		if (err < 0)
-			return err;
-		dice->rx_pcm_chs[i][mode] = be32_to_cpu(reg[0]);
-		dice->rx_midi_ports[i] = max_t(unsigned int,
-				be32_to_cpu(reg[1]), dice->rx_midi_ports[i]);
+	err = read_stream_formats(dice, AMDTP_IN_STREAM, &tx_params, mode,
+				  NULL);
+	if (err < 0)
+		return err;
+
+	err = read_stream_formats(dice, AMDTP_OUT_STREAM, &rx_params, mode,
+				  NULL);
+	if (err < 0)
+		return err;
+
+	// The formats in the other modes are detected after registration of
+	// the card, since selecting each mode takes long time.
+	for (i = 0; i < ARRAY_SIZE(snd_dice_rates); ++i) {
+		enum snd_dice_rate_mode m;
+
+		if (snd_dice_stream_get_rate_mode(dice, snd_dice_rates[i],
+						  &m) < 0)
+			continue;
+		if (m != mode)
+			dice->undetected_modes |= BIT(m);
 	}
 
 	return 0;
 }
 
+static int detect_mode_formats(struct snd_dice *dice,
+			       enum snd_dice_rate_mode mode)
+{
+	struct reg_params tx_params, rx_params;
+	enum snd_dice_rate_mode m;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(snd_dice_rates); ++i) {
+		if (snd_dice_stream_get_rate_mode(dice, snd_dice_rates[i],
+						  &m) >= 0 && m == mode)
+			break;
+	}
+	if (i == ARRAY_SIZE(snd_dice_rates))
+		return -EINVAL;
+
+	err = select_clock(dice, snd_dice_rates[i]);
+	if (err < 0)
+		return err;
+
+	err = get_register_params(dice, &tx_params, &rx_params);
+	if (err < 0)
+		return err;
+
+	err = read_stream_formats(dice, AMDTP_IN_STREAM, &tx_params, mode,
+				  NULL);
+	if (err < 0)
+		return err;
+
+	return read_stream_formats(dice, AMDTP_OUT_STREAM, &rx_params, mode,
+				   NULL);
+}
+
 static void dice_lock_changed(struct snd_dice *dice)
 {
-	dice->dev_lock_changed = true;
+	atomic_set(&dice->dev_lock_changed, 1);
 	wake_up(&dice->hwdep_wait);
 }
 
-int snd_dice_stream_lock_try(struct snd_dice *dice)
+// The unit is held during the detection so that userspace can not acquire the
+// lock for hwdep. The hold is not notified to userspace, since the detection
+// takes just a short time, while any substream can join in it meanwhile.
+static bool hold_for_detection(struct snd_dice *dice)
+{
+	return atomic_cmpxchg(&dice->dev_lock_count, 0, 1) == 0;
+}
+
+static void release_for_detection(struct snd_dice *dice)
+{
+	// Any substream joined in the hold without notification.
+	if (atomic_dec_return(&dice->dev_lock_count) > 0)
+		dice_lock_changed(dice);
+}
+
+void snd_dice_stream_detect_remaining_formats(struct work_struct *work)
 {
+	struct snd_dice *dice = container_of(work, struct snd_dice, detect_work);
+	unsigned int source, rate;
+	enum snd_dice_rate_mode mode;
 	int err;
 
+	mutex_lock(&dice->mutex);
+
+	// Userspace application or any substream uses the unit. The detection
+	// is retried when the session is finished. Any substream opened
+	// meanwhile waits for the mutex to read the restored rate.
+	if (dice->substreams_counter > 0 || !hold_for_detection(dice))
+		goto end;
+
+	// Changing the rate is not allowed for external source of clock.
+	err = snd_dice_transaction_get_clock_source(dice, &source);
+	if (err < 0 || source != CLOCK_SOURCE_INTERNAL)
+		goto release;
+
+	err = snd_dice_transaction_get_rate(dice, &rate);
+	if (err < 0)
+		goto release;
+
+	for (mode = 0; mode < SND_DICE_RATE_MODE_COUNT; ++mode) {
+		if (!(dice->undetected_modes & BIT(mode)))
+			continue;
+
+		err = detect_mode_formats(dice, mode);
+		if (err < 0) {
+			dev_info(&dice->unit->device,
+				 "fail to detect formats in mode %u: %d\n",
+				 mode, err);
+			break;
+		}
+
+		dice->undetected_modes &= ~BIT(mode);
+	}
+
+	// Restore the original rate.
+	err = select_clock(dice, rate);
+	if (err < 0)
+		dev_info(&dice->unit->device,
+			 "fail to restore rate %u: %d\n", rate, err);
+
+	snd_dice_cache_store(dice);
+release:
+	release_for_detection(dice);
+end:
+	mutex_unlock(&dice->mutex);
+}
+
+void snd_dice_stream_reload_formats(struct work_struct *work)
+{
+	struct snd_dice *dice = container_of(work, struct snd_dice, format_work);
+	struct reg_params tx_params, rx_params;
+	enum snd_dice_rate_mode mode;
+	unsigned int rate, index;
+	bool changed = false;
+	bool rate_changed = false;
+	u32 bits, status;
+	unsigned int i;
+	int err;
+
+	mutex_lock(&dice->mutex);
+
+	// Any notification till here is handled together.
 	spin_lock_irq(&dice->lock);
+	bits = dice->format_change_bits;
+	dice->format_change_bits = 0;
+	status = dice->global_shadow.status;
+	spin_unlock_irq(&dice->lock);
+
+	err = snd_dice_transaction_get_rate(dice, &rate);
+	if (err < 0)
+		goto end;
+
+	// The external source of clock changed its rate.
+	if (bits & NOTIFY_LOCK_CHG) {
+		index = (status & STATUS_NOMINAL_RATE_MASK) >> CLOCK_RATE_SHIFT;
+		if (index < SND_DICE_RATES_COUNT &&
+		    snd_dice_rates[index] != rate) {
+			rate = snd_dice_rates[index];
+			rate_changed = true;
+		}
+	}
+
+	err = snd_dice_stream_get_rate_mode(dice, rate, &mode);
+	if (err < 0)
+		goto end;
+	err = get_register_params(dice, &tx_params, &rx_params);
+	if (err < 0)
+		goto end;
 
-	if (dice->dev_lock_count < 0) {
-		err = -EBUSY;
-		goto out;
+	// The formats in the new mode are read as well, since the mode can be
+	// undetected yet when the external source of clock is used, for which
+	// the background detection is skipped.
+	if ((bits & NOTIFY_TX_CFG_CHG) || rate_changed) {
+		err = read_stream_formats(dice, AMDTP_IN_STREAM, &tx_params,
+					  mode, &changed);
+		if (err < 0)
+			goto end;
+	}
+	if ((bits & NOTIFY_RX_CFG_CHG) || rate_changed) {
+		err = read_stream_formats(dice, AMDTP_OUT_STREAM, &rx_params,
+					  mode, &changed);
+		if (err < 0)
+			goto end;
+	}
+	if (rate_changed && (dice->undetected_modes & BIT(mode))) {
+		dice->undetected_modes &= ~BIT(mode);
+		changed = true;
 	}
 
-	if (dice->dev_lock_count++ == 0)
+	// The entry loaded at runtime precedes the registers.
+	snd_dice_model_reload_formats(dice, &changed);
+
+	// The running session is based on the former formats or rate. Stop it
+	// and let the substreams know it. The resources are kept again at next
+	// preparation.
+	if ((changed || rate_changed) && dice->substreams_counter > 0) {
+		if (rate_changed) {
+			dev_info(&dice->unit->device,
+				 "sampling rate changed to %u by clock source, reopen PCM substreams\n",
+				 rate);
+		} else {
+			dev_info(&dice->unit->device,
+				 "stream formats changed by the unit, reopen PCM substreams\n");
+		}
+
+		amdtp_domain_stop(&dice->domain);
+		finish_session(dice, &tx_params, &rx_params);
+
+		for (i = 0; i < MAX_STREAMS; ++i) {
+			amdtp_stream_pcm_abort(&dice->tx_stream[i]);
+			amdtp_stream_pcm_abort(&dice->rx_stream[i]);
+		}
+
+		dice->params_stale = true;
+
+		// Keep the resources for the new rate mode at once. The PCM
+		// substreams fail to prepare with the former rate and should
+		// be reopened to select the new one, while the session just
+		// for MIDI substreams is resumed since it has no parameters
+		// decided by applications.
+		if (rate_changed) {
+			struct amdtp_domain *d = &dice->domain;
+
+			err = snd_dice_stream_reserve_duplex(dice, rate,
+					dice->midi_only ? 0 : d->events_per_period,
+					d->events_per_buffer);
+			if (err >= 0 && dice->midi_only)
+				snd_dice_stream_start_duplex(dice);
+		}
+	}
+
+	if (changed)
+		snd_dice_cache_store(dice);
+end:
+	mutex_unlock(&dice->mutex);
+}
+
+int snd_dice_stream_lock_try(struct snd_dice *dice)
+{
+	int count = atomic_read(&dice->dev_lock_count);
+
+	do {
+		if (count < 0)
+			return -EBUSY;
+	} while (!atomic_try_cmpxchg(&dice->dev_lock_count, &count, count + 1));
+
+	if (count == 0)
 		dice_lock_changed(dice);
-	err = 0;
-out:
-	spin_unlock_irq(&dice->lock);
-	return err;
+
+	return 0;
 }
 
 void snd_dice_stream_lock_release(struct snd_dice *dice)
 {
-	spin_lock_irq(&dice->lock);
+	int count = atomic_dec_if_positive(&dice->dev_lock_count);
 
-	if (WARN_ON(dice->dev_lock_count <= 0))
-		goto out;
+	if (WARN_ON(count < 0))
+		return;
 
-	if (--dice->dev_lock_count == 0)
+	if (count == 0) {
 		dice_lock_changed(dice);
-out:
-	spin_unlock_irq(&dice->lock);
+		snd_dice_stream_retry_detection(dice);
+	}
+}
+
+// The detection skipped during the lock is retried.
+void snd_dice_stream_retry_detection(struct snd_dice *dice)
+{
+	if (READ_ONCE(dice->undetected_modes) != 0)
+		schedule_work(&dice->detect_work);
 }
@@ -129,6 +129,125 @@ void snd_dice_transaction_clear_enable(struct snd_dice *dice)
 	dice->global_enabled = false;
 }
 
+static int refresh_global_shadow(struct snd_dice *dice)
+{
+	__be32 reg[(GLOBAL_SAMPLE_RATE - GLOBAL_CLOCK_SELECT) / 4 + 1];
+	struct snd_dice_global_shadow *shadow = &dice->global_shadow;
+	int err;
+
+	err = snd_dice_transaction_read_global(dice, GLOBAL_CLOCK_SELECT,
+					       reg, sizeof(reg));
+	if (err < 0)
+		return err;
+
+	// The _SLIP bits are cleared by quadlet read only. Read it again so that
+	// the bits in the shadow tell slips since the last refresh.
+	err = snd_dice_transaction_read_global(dice, GLOBAL_EXTENDED_STATUS,
+			&reg[(GLOBAL_EXTENDED_STATUS - GLOBAL_CLOCK_SELECT) / 4], 4);
+	if (err < 0)
+		return err;
+
+	spin_lock_irq(&dice->lock);
+	shadow->clock_select = be32_to_cpu(reg[0]);
+	shadow->enable =
+		be32_to_cpu(reg[(GLOBAL_ENABLE - GLOBAL_CLOCK_SELECT) / 4]);
+	shadow->status =
+		be32_to_cpu(reg[(GLOBAL_STATUS - GLOBAL_CLOCK_SELECT) / 4]);
+	shadow->ext_status =
+		be32_to_cpu(reg[(GLOBAL_EXTENDED_STATUS - GLOBAL_CLOCK_SELECT) / 4]);
+	shadow->sample_rate =
+		be32_to_cpu(reg[(GLOBAL_SAMPLE_RATE - GLOBAL_CLOCK_SELECT) / 4]);
+	spin_unlock_irq(&dice->lock);
+
+	return 0;
+}
+
+static void account_clock_events(struct snd_dice *dice, u32 old_ext_status)
+{
+	struct snd_firewire_dice_clock_source_stats *stats;
+	u32 ext_status;
+	u64 now = ktime_get_ns();
+	unsigned int i;
+
+	spin_lock_irq(&dice->lock);
+	ext_status = dice->global_shadow.ext_status;
+	for (i = 0; i < SND_DICE_EXT_SOURCE_COUNT; ++i) {
+		stats = &dice->clock_stats.sources[i];
+		if (ext_status & (EXT_STATUS_AES1_SLIP << i)) {
+			++stats->slips;
+			stats->last_slip_ns = now;
+		}
+		if ((old_ext_status & ~ext_status) & BIT(i)) {
+			++stats->unlocks;
+			stats->last_unlock_ns = now;
+		}
+	}
+	spin_unlock_irq(&dice->lock);
+}
+
+// When the unit follows an external source, the nominal rate can be changed by
+// the source. The running session is reconfigured in the work for formats.
+static void check_external_rate(struct snd_dice *dice,
+				const struct snd_dice_global_shadow *old)
+{
+	struct snd_dice_global_shadow *shadow = &dice->global_shadow;
+	unsigned int source;
+
+	spin_lock_irq(&dice->lock);
+	source = shadow->clock_select & CLOCK_SOURCE_MASK;
+	// AES1-4, AES, ADAT, TDIF and WC.
+	if (source <= CLOCK_SOURCE_WC &&
+	    (shadow->status & STATUS_SOURCE_LOCKED) &&
+	    ((shadow->status ^ old->status) & STATUS_NOMINAL_RATE_MASK))
+		dice->format_change_bits |= NOTIFY_LOCK_CHG;
+	spin_unlock_irq(&dice->lock);
+}
+
+// Notifications in a burst are coalesced into one run of the work.
+static void notification_work(struct work_struct *work)
+{
+	struct snd_dice *dice =
+			container_of(work, struct snd_dice, notification_work);
+	struct snd_dice_global_shadow old;
+	bool reload;
+	u32 bits;
+
+	spin_lock_irq(&dice->lock);
+	bits = dice->pending_notification_bits;
+	dice->pending_notification_bits = 0;
+	old = dice->global_shadow;
+	spin_unlock_irq(&dice->lock);
+
+	if (bits == 0)
+		return;
+
+	// The waiter has the timeout, thus it is woken up before the shadow is
+	// refreshed by transactions.
+	if (bits & NOTIFY_CLOCK_ACCEPTED)
+		complete(&dice->clock_accepted);
+
+	if (bits & (NOTIFY_LOCK_CHG | NOTIFY_CLOCK_ACCEPTED | NOTIFY_EXT_STATUS)) {
+		if (refresh_global_shadow(dice) >= 0) {
+			account_clock_events(dice, old.ext_status);
+			snd_dice_control_notify(dice, &old);
+			if (bits & NOTIFY_LOCK_CHG)
+				check_external_rate(dice, &old);
+		}
+	}
+
+	spin_lock_irq(&dice->lock);
+	dice->notification_bits |= bits;
+	dice->format_change_bits |= bits & (NOTIFY_RX_CFG_CHG | NOTIFY_TX_CFG_CHG);
+	reload = (dice->format_change_bits != 0);
+	spin_unlock_irq(&dice->lock);
+
+	// The reload takes the mutex, which can be held by a waiter of the
+	// clock-accepted completion. It runs in another work.
+	if (reload)
+		schedule_work(&dice->format_work);
+	wake_up(&dice->hwdep_wait);
+}
+
 static void dice_notification(struct fw_card *card, struct fw_request *request,
 			      int tcode, int destination, int source,
 			      int generation, unsigned long long offset,
@@ -150,14 +269,12 @@ static void dice_notification(struct fw_card *card, struct fw_request *request,
 	bits = be32_to_cpup(data);
 
 	spin_lock_irqsave(&dice->lock, flags);
-	dice->notification_bits |= bits;
+	dice->pending_notification_bits |= bits;
 	spin_unlock_irqrestore(&dice->lock, flags);
 
 	fw_send_response(card, request, RCODE_COMPLETE);
 
-	if (bits & NOTIFY_CLOCK_ACCEPTED)
-		complete(&dice->clock_accepted);
-	wake_up(&dice->hwdep_wait);
+	schedule_work(&dice->notification_work);
 }
 
 static int register_notification_address(struct snd_dice *dice, bool retry)
@@ -249,6 +366,8 @@ void snd_dice_transaction_destroy(struct snd_dice *dice)
 
 	fw_core_remove_address_handler(handler);
 	handler->callback_data = NULL;
+
+	cancel_work_sync(&dice->notification_work);
 }
 
 int snd_dice_transaction_reinit(struct snd_dice *dice)
@@ -323,6 +442,7 @@ static int get_subaddrs(struct snd_dice *dice)
 
 		/* Set up later. */
 		dice->clock_caps = 1;
+		dice->global_version = be32_to_cpu(version);
 	}
 
 	dice->global_offset = be32_to_cpu(pointers[0]) * 4;
@@ -348,6 +468,12 @@ int snd_dice_transaction_init(struct snd_dice *dice)
 	if (err < 0)
 		return err;
 
+	err = refresh_global_shadow(dice);
+	if (err < 0)
+		return err;
+
+	INIT_WORK(&dice->notification_work, notification_work);
+
 	/* Allocation callback in address space over host controller */
 	handler->length = 4;
 	handler->address_callback = dice_notification;
@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * dice-uapi.h - a part of driver for DICE based devices
+ *
+ * Interfaces of hwdep device specific to DICE, in addition to the ones in
+ * <sound/firewire.h>. The header has no dependency on the driver, thus
+ * userspace applications can include it. The numbers of ioctl follow the
+ * SNDRV_FIREWIRE_IOCTL_* in <sound/firewire.h> downward from 0xf7.
+ */
+
+#ifndef SOUND_DICE_UAPI_H_INCLUDED
+#define SOUND_DICE_UAPI_H_INCLUDED
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * The ring of peak meters, mapped read-only by mmap(2) of the second hwdep
+ * device of the card, named 'DICE meter', at offset 0. The device is not
+ * exclusive, thus any number of processes can map the ring. The first page
+ * includes the header, thus the whole size is computed by the header. The unit
+ * is polled while the ring is mapped by any process.
+ *
+ * All of fields are in host endian. The position counts frames written so far,
+ * and the frame at (position - 1) % frame_count is the latest one. The
+ * position is updated after the frame is filled.
+ */
+struct snd_firewire_dice_meter_ring {
+	__u32 frame_count;
+	__u32 frame_size;	/* In bytes, including header of frame. */
+	__u32 position;
+	__u32 reserved;
+	__u8 frames[];
+};
+
+struct snd_firewire_dice_meter_frame {
+	__u64 tstamp;		/* CLOCK_MONOTONIC in nanoseconds. */
+	__u32 sequence;
+	__u32 peak_count;
+	__u32 peaks[];		/* Quadlets in the peak section. */
+};
+
+/*
+ * The sources with _LOCKED and _SLIP bits in GLOBAL_EXTENDED_STATUS; AES1-4,
+ * ADAT, TDIF, ARX1-4 and WC, in the order of bits.
+ */
+#define SNDRV_FIREWIRE_DICE_EXT_SOURCE_COUNT	11
+
+/*
+ * Events of clock source accounted by notification. The timestamps are in
+ * CLOCK_MONOTONIC nanoseconds, or zero if the event has not occurred.
+ */
+struct snd_firewire_dice_clock_source_stats {
+	__u32 slips;
+	__u32 unlocks;
+	__u64 last_slip_ns;
+	__u64 last_unlock_ns;
+};
+
+struct snd_firewire_dice_clock_stats {
+	struct snd_firewire_dice_clock_source_stats
+				sources[SNDRV_FIREWIRE_DICE_EXT_SOURCE_COUNT];
+};
+
+#define SNDRV_FIREWIRE_IOCTL_DICE_GET_CLOCK_STATS \
+	_IOR('H', 0xf7, struct snd_firewire_dice_clock_stats)
+
+/*
+ * The deviation of sampling clock is measured only in the callback to query
+ * position of the first capture PCM substream, thus it is not estimated unless
+ * any application runs the substream and queries the position periodically.
+ * The state tells the reason when the estimate is not available.
+ */
+#define SNDRV_FIREWIRE_DICE_DRIFT_VALID		0
+#define SNDRV_FIREWIRE_DICE_DRIFT_NOT_RUNNING	1	/* The substream stops. */
+#define SNDRV_FIREWIRE_DICE_DRIFT_MEASURING	2	/* No window completes. */
+#define SNDRV_FIREWIRE_DICE_DRIFT_NOT_POLLED	3	/* No query recently. */
+
+/*
+ * The estimated deviation of sampling clock from the nominal rate, and the
+ * average of absolute deviation of measurements from the estimation, in parts
+ * per billion. The fields except for the state are zero unless it is valid.
+ *
+ * Each measurement is the slope of line fitted to the positions observed over
+ * ten seconds. The observation has error of a packet and of the scheduling of
+ * the query, since the timestamp of packet is not available. The jitter tells
+ * the resolution, which is likely insufficient for control of resampler.
+ */
+struct snd_firewire_dice_drift {
+	__u32 state;		/* One of SNDRV_FIREWIRE_DICE_DRIFT_*. */
+	__u32 rate;
+	__u32 measurements;
+	__u32 reserved;
+	__s64 ppb;
+	__u64 jitter_ppb;
+};
+
+#define SNDRV_FIREWIRE_IOCTL_DICE_GET_DRIFT \
+	_IOR('H', 0xf6, struct snd_firewire_dice_drift)
+
+/*
+ * The sections of configuration in protocol extension. The content is in big
+ * endian as in the unit.
+ */
+#define SNDRV_FIREWIRE_DICE_CONFIG_ROUTER	0
+#define SNDRV_FIREWIRE_DICE_CONFIG_MIXER	1
+
+struct snd_firewire_dice_config {
+	__u32 section;		/* One of SNDRV_FIREWIRE_DICE_CONFIG_*. */
+	__u32 size;		/* In bytes. */
+	__u64 data;		/* Pointer to the content. */
+};
+
+/*
+ * The size is updated with the size of section by READ_CONFIG, while it should
+ * be the size of section for WRITE_CONFIG. The write is applied to the ranges
+ * differing from the content in the unit.
+ */
+#define SNDRV_FIREWIRE_IOCTL_DICE_READ_CONFIG \
+	_IOWR('H', 0xf5, struct snd_firewire_dice_config)
+#define SNDRV_FIREWIRE_IOCTL_DICE_WRITE_CONFIG \
+	_IOW('H', 0xf4, struct snd_firewire_dice_config)
+
+#endif
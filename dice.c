@@ -11,24 +11,14 @@ MODULE_DESCRIPTION("DICE driver");
 MODULE_AUTHOR("Clemens Ladisch <clemens@ladisch.de>");
 MODULE_LICENSE("GPL");
 
-#define OUI_WEISS		0x001c6a
-#define OUI_LOUD		0x000ff2
-#define OUI_FOCUSRITE		0x00130e
-#define OUI_TCELECTRONIC	0x000166
-#define OUI_ALESIS		0x000595
-#define OUI_MAUDIO		0x000d6c
-#define OUI_MYTEK		0x001ee8
-#define OUI_SSL			0x0050c2	// Actually ID reserved by IEEE.
-#define OUI_PRESONUS		0x000a92
-#define OUI_HARMAN		0x000fd7
-#define OUI_AVID		0x00a07e
-
 #define DICE_CATEGORY_ID	0x04
 #define WEISS_CATEGORY_ID	0x00
 #define LOUD_CATEGORY_ID	0x10
 #define HARMAN_CATEGORY_ID	0x20
 
-#define MODEL_ALESIS_IO_BOTH	0x000001
+static bool low_latency;
+module_param(low_latency, bool, 0444);
+MODULE_PARM_DESC(low_latency, "Use low-latency profile for packet streaming (default: false)");
 
 static int check_dice_category(struct fw_unit *unit)
 {
@@ -70,6 +60,36 @@ static int check_dice_category(struct fw_unit *unit)
 	return 0;
 }
 
+// The IDs of matched entry are used for the specific models, since some of them
+// have quirks in their unit directory.
+static void get_model_ids(struct fw_unit *unit,
+			  const struct ieee1394_device_id *entry,
+			  u32 *vendor_id, u32 *model_id)
+{
+	struct fw_csr_iterator it;
+	int key, val;
+
+	if (entry->match_flags & IEEE1394_MATCH_MODEL_ID) {
+		*vendor_id = entry->vendor_id;
+		*model_id = entry->model_id;
+		return;
+	}
+
+	*vendor_id = 0;
+	*model_id = 0;
+	fw_csr_iterator_init(&it, unit->directory);
+	while (fw_csr_iterator_next(&it, &key, &val)) {
+		switch (key) {
+		case CSR_SPECIFIER_ID:
+			*vendor_id = val;
+			break;
+		case CSR_MODEL:
+			*model_id = val;
+			break;
+		}
+	}
+}
+
 static int check_clock_caps(struct snd_dice *dice)
 {
 	__be32 value;
@@ -133,8 +153,11 @@ static void dice_card_free(struct snd_card *card)
 {
 	struct snd_dice *dice = card->private_data;
 
-	snd_dice_stream_destroy_duplex(dice);
 	snd_dice_transaction_destroy(dice);
+	cancel_work_sync(&dice->format_work);
+	cancel_work_sync(&dice->detect_work);
+	snd_dice_stream_destroy_duplex(dice);
+	snd_dice_destroy_meter(dice);
 
 	mutex_destroy(&dice->mutex);
 	fw_unit_put(dice->unit);
@@ -144,10 +167,12 @@ static int dice_probe(struct fw_unit *unit, const struct ieee1394_device_id *ent
 {
 	struct snd_card *card;
 	struct snd_dice *dice;
-	snd_dice_detect_formats_t detect_formats;
+	const struct snd_dice_model *model;
+	bool cached;
 	int err;
 
-	if (!entry->driver_data && entry->vendor_id != OUI_SSL) {
+	// The entries for specific models are known to be DICE based.
+	if (!(entry->match_flags & IEEE1394_MATCH_MODEL_ID)) {
 		err = check_dice_category(unit);
 		if (err < 0)
 			return -ENODEV;
@@ -163,37 +188,46 @@ static int dice_probe(struct fw_unit *unit, const struct ieee1394_device_id *ent
 	dev_set_drvdata(&unit->device, dice);
 	dice->card = card;
 
-	if (!entry->driver_data)
-		detect_formats = snd_dice_stream_detect_current_formats;
-	else
-		detect_formats = (snd_dice_detect_formats_t)entry->driver_data;
-
-	// Below models are compliant to IEC 61883-1/6 and have no quirk at high sampling transfer
-	// frequency.
-	// * Avid M-Box 3 Pro
-	// * M-Audio Profire 610
-	// * M-Audio Profire 2626
-	if (entry->vendor_id == OUI_MAUDIO || entry->vendor_id == OUI_AVID)
-		dice->disable_double_pcm_frames = true;
+	dice->low_latency = low_latency;
 
 	spin_lock_init(&dice->lock);
 	mutex_init(&dice->mutex);
 	init_completion(&dice->clock_accepted);
 	init_waitqueue_head(&dice->hwdep_wait);
+	INIT_WORK(&dice->format_work, snd_dice_stream_reload_formats);
+	INIT_WORK(&dice->detect_work, snd_dice_stream_detect_remaining_formats);
 
 	err = snd_dice_transaction_init(dice);
 	if (err < 0)
 		goto error;
 
-	err = check_clock_caps(dice);
-	if (err < 0)
-		goto error;
+	get_model_ids(unit, entry, &dice->vendor_id, &dice->model_id);
+	model = snd_dice_model_lookup(dice);
+	if (model && (model->quirks & SND_DICE_QUIRK_NO_DOUBLE_PCM_FRAMES))
+		dice->disable_double_pcm_frames = true;
+
+	// Known unit skips detection of clock capabilities and stream formats.
+	// The entry loaded at runtime is preferred to the cache.
+	cached = !dice->model_overridden &&
+		 (snd_dice_cache_restore(dice) >= 0);
+	if (!cached) {
+		err = check_clock_caps(dice);
+		if (err < 0)
+			goto error;
+	}
 
 	dice_card_strings(dice);
 
-	err = detect_formats(dice);
-	if (err < 0)
-		goto error;
+	if (!cached) {
+		if (model)
+			err = snd_dice_model_detect_formats(dice, model);
+		else
+			err = snd_dice_stream_detect_current_formats(dice);
+		if (err < 0)
+			goto error;
+
+		snd_dice_cache_store(dice);
+	}
 
 	err = snd_dice_stream_init_duplex(dice);
 	if (err < 0)
@@ -209,14 +243,25 @@ static int dice_probe(struct fw_unit *unit, const struct ieee1394_device_id *ent
 	if (err < 0)
 		goto error;
 
+	err = snd_dice_create_meter(dice);
+	if (err < 0)
+		goto error;
+
 	err = snd_dice_create_hwdep(dice);
 	if (err < 0)
 		goto error;
 
+	err = snd_dice_create_control(dice);
+	if (err < 0)
+		goto error;
+
 	err = snd_card_register(card);
 	if (err < 0)
 		goto error;
 
+	if (dice->undetected_modes != 0)
+		schedule_work(&dice->detect_work);
+
 	return 0;
 error:
 	snd_card_free(card);
@@ -245,7 +290,7 @@ static void dice_bus_reset(struct fw_unit *unit)
 
 #define DICE_INTERFACE	0x000001
 
-#define DICE_DEV_ENTRY_TYPICAL(vendor, model, data) \
+#define DICE_DEV_ENTRY_TYPICAL(vendor, model) \
 	{ \
 		.match_flags	= IEEE1394_MATCH_VENDOR_ID | \
 				  IEEE1394_MATCH_MODEL_ID | \
@@ -255,19 +300,17 @@ static void dice_bus_reset(struct fw_unit *unit)
 		.model_id	= (model), \
 		.specifier_id	= (vendor), \
 		.version	= DICE_INTERFACE, \
-		.driver_data = (kernel_ulong_t)(data), \
 	}
 
 static const struct ieee1394_device_id dice_id_table[] = {
 	// Avid M-Box 3 Pro. To match in probe function.
-	DICE_DEV_ENTRY_TYPICAL(OUI_AVID, 0x000004, snd_dice_detect_extension_formats),
+	DICE_DEV_ENTRY_TYPICAL(OUI_AVID, 0x000004),
 	/* M-Audio Profire 2626 has a different value in version field. */
 	{
 		.match_flags	= IEEE1394_MATCH_VENDOR_ID |
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_MAUDIO,
 		.model_id	= 0x000010,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_extension_formats,
 	},
 	/* M-Audio Profire 610 has a different value in version field. */
 	{
@@ -275,7 +318,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_MAUDIO,
 		.model_id	= 0x000011,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_extension_formats,
 	},
 	/* TC Electronic Konnekt 24D. */
 	{
@@ -283,7 +325,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000020,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* TC Electronic Konnekt 8. */
 	{
@@ -291,7 +332,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000021,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* TC Electronic Studio Konnekt 48. */
 	{
@@ -299,7 +339,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000022,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* TC Electronic Konnekt Live. */
 	{
@@ -307,7 +346,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000023,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* TC Electronic Desktop Konnekt 6. */
 	{
@@ -315,7 +353,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000024,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* TC Electronic Impact Twin. */
 	{
@@ -323,7 +360,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000027,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* TC Electronic Digital Konnekt x32. */
 	{
@@ -331,7 +367,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_TCELECTRONIC,
 		.model_id	= 0x000030,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_tcelectronic_formats,
 	},
 	/* Alesis iO14/iO26. */
 	{
@@ -339,7 +374,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_ALESIS,
 		.model_id	= MODEL_ALESIS_IO_BOTH,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_alesis_formats,
 	},
 	// Alesis MasterControl.
 	{
@@ -347,7 +381,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_ALESIS,
 		.model_id	= 0x000002,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_alesis_mastercontrol_formats,
 	},
 	/* Mytek Stereo 192 DSD-DAC. */
 	{
@@ -355,7 +388,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_MYTEK,
 		.model_id	= 0x000002,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_mytek_formats,
 	},
 	// Solid State Logic, Duende Classic and Mini.
 	// NOTE: each field of GUID in config ROM is not compliant to standard
@@ -372,7 +404,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_PRESONUS,
 		.model_id	= 0x000008,
-		.driver_data	= (kernel_ulong_t)snd_dice_detect_presonus_formats,
 	},
 	// Lexicon I-ONYX FW810S.
 	{
@@ -380,7 +411,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_HARMAN,
 		.model_id	= 0x000001,
-		.driver_data	= (kernel_ulong_t)snd_dice_detect_harman_formats,
 	},
 	// Focusrite Saffire Pro 40 with TCD3070-CH.
 	// The model has quirk in its GUID, in which model field is 0x000013 and different from
@@ -390,7 +420,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_FOCUSRITE,
 		.model_id	= 0x0000de,
-		.driver_data	= (kernel_ulong_t)snd_dice_detect_focusrite_pro40_tcd3070_formats,
 	},
 	{
 		.match_flags = IEEE1394_MATCH_VERSION,
@@ -402,7 +431,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000007,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss DAC202: 192kHz 2-channel DAC (Maya edition) */
 	{
@@ -410,7 +438,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000008,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss MAN301: 192kHz 2-channel music archive network player */
 	{
@@ -418,7 +445,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x00000b,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss INT202: 192kHz unidirectional 2-channel digital Firewire interface */
 	{
@@ -426,7 +452,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000006,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss INT203: 192kHz bidirectional 2-channel digital Firewire interface */
 	{
@@ -434,7 +459,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x00000a,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss ADC2: 192kHz A/D converter with microphone preamps and line inputs */
 	{
@@ -442,7 +466,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000001,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss DAC2/Minerva: 192kHz 2-channel DAC */
 	{
@@ -450,7 +473,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000003,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss Vesta: 192kHz 2-channel Firewire to AES/EBU interface */
 	{
@@ -458,7 +480,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000002,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	/* Weiss AFI1: 192kHz 24-channel Firewire to ADAT or AES/EBU interface */
 	{
@@ -466,7 +487,6 @@ static const struct ieee1394_device_id dice_id_table[] = {
 				  IEEE1394_MATCH_MODEL_ID,
 		.vendor_id	= OUI_WEISS,
 		.model_id	= 0x000004,
-		.driver_data = (kernel_ulong_t)snd_dice_detect_weiss_formats,
 	},
 	{ }
 };
@@ -492,6 +512,7 @@ static int __init alsa_dice_init(void)
 static void __exit alsa_dice_exit(void)
 {
 	driver_unregister(&dice_driver.driver);
+	snd_dice_cache_clear();
 }
 
 module_init(alsa_dice_init);
@@ -9,6 +9,7 @@
 #ifndef SOUND_DICE_H_INCLUDED
 #define SOUND_DICE_H_INCLUDED
 
+#include <linux/atomic.h>
 #include <linux/compat.h>
 #include <linux/completion.h>
 #include <linux/delay.h>
@@ -22,6 +23,7 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/sched/signal.h>
 
 #include <sound/control.h>
@@ -38,6 +40,7 @@
 #include "../iso-resources.h"
 #include "../lib.h"
 #include "dice-interface.h"
+#include "dice-uapi.h"
 
 /*
  * This module support maximum 2 pairs of tx/rx isochronous streams for
@@ -57,8 +60,8 @@
  *   - Maximum 2 tx and 2 rx are supported.
  *   - A packet supports maximum 32 data channels.
  *
- * For the above, MIDI conformant data channel is just on the first isochronous
- * stream.
+ * For the above, MIDI conformant data channel can be on any isochronous stream.
+ * The MIDI substreams are numbered in order of the stream carrying the port.
  */
 #define MAX_STREAMS	2
 
@@ -69,9 +72,192 @@ enum snd_dice_rate_mode {
 	SND_DICE_RATE_MODE_COUNT,
 };
 
+/* Names of channels in stream entry of the protocol extension. */
+#define SND_DICE_CHANNEL_NAMES_SIZE	256
+
+/* Sections in the protocol extension for TCD2210/2220. */
+enum snd_dice_ext_section {
+	SND_DICE_EXT_SECTION_CAPS = 0,
+	SND_DICE_EXT_SECTION_CMD,
+	SND_DICE_EXT_SECTION_MIXER,
+	SND_DICE_EXT_SECTION_PEAK,
+	SND_DICE_EXT_SECTION_ROUTER,
+	SND_DICE_EXT_SECTION_STREAM,
+	SND_DICE_EXT_SECTION_CURRENT,
+	SND_DICE_EXT_SECTION_STANDALONE,
+	SND_DICE_EXT_SECTION_APPLICATION,
+	SND_DICE_EXT_SECTION_COUNT,
+};
+
+/* In bytes from the base of the protocol extension. */
+struct snd_dice_ext_section_info {
+	unsigned int offset;
+	unsigned int size;
+};
+
+/* The 1394 cycle timer counts ticks at 24.576 MHz and wraps every 128 seconds. */
+#define SND_DICE_TICKS_PER_CYCLE	3072
+#define SND_DICE_CYCLES_PER_SECOND	8000
+#define SND_DICE_TICKS_PER_SECOND	(SND_DICE_TICKS_PER_CYCLE * \
+					 SND_DICE_CYCLES_PER_SECOND)
+#define SND_DICE_TICKS_PER_WRAP		(128u * SND_DICE_TICKS_PER_SECOND)
+
+/*
+ * The default transfer delay of IEC 61883-6, used for presentation time of
+ * packets to the unit.
+ */
+#define SND_DICE_TRANSFER_DELAY_TICKS	0x2e00
+
 struct snd_dice;
 typedef int (*snd_dice_detect_formats_t)(struct snd_dice *dice);
 
+#define OUI_WEISS		0x001c6a
+#define OUI_LOUD		0x000ff2
+#define OUI_FOCUSRITE		0x00130e
+#define OUI_TCELECTRONIC	0x000166
+#define OUI_ALESIS		0x000595
+#define OUI_MAUDIO		0x000d6c
+#define OUI_MYTEK		0x001ee8
+#define OUI_SSL			0x0050c2	// Actually ID reserved by IEEE.
+#define OUI_PRESONUS		0x000a92
+#define OUI_HARMAN		0x000fd7
+#define OUI_AVID		0x00a07e
+
+#define MODEL_ALESIS_IO_BOTH	0x000001
+
+/* No doubled PCM frames in packet at high sampling transfer frequency. */
+#define SND_DICE_QUIRK_NO_DOUBLE_PCM_FRAMES	BIT(0)
+
+/*
+ * An entry of model database. The stream formats are detected by the function
+ * if any, else given by the tables.
+ */
+struct snd_dice_model {
+	u32 vendor_id;
+	u32 model_id;
+	/* The range of GLOBAL_VERSION. Zero for no limit. */
+	u32 min_version;
+	u32 max_version;
+	snd_dice_detect_formats_t detect_formats;
+	unsigned int tx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	unsigned int rx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
+	unsigned int tx_midi_ports[MAX_STREAMS];
+	unsigned int rx_midi_ports[MAX_STREAMS];
+	/* In frames, for A/D and D/A conversion. Zero if unknown. */
+	unsigned int tx_latency[SND_DICE_RATE_MODE_COUNT];
+	unsigned int rx_latency[SND_DICE_RATE_MODE_COUNT];
+	unsigned int quirks;
+};
+
+/*
+ * The position of PCM frames estimated between processed packets. The anchor
+ * is the latest processed position and the value of 1394 cycle timer when it
+ * was observed first.
+ */
+struct snd_dice_pcm_position {
+	snd_pcm_uframes_t anchor;
+	u32 anchor_ticks;
+	bool valid;
+};
+
+/*
+ * Estimation of the rate of sampling clock in the unit against 1394 cycle
+ * clock, from the frames processed in the first capture stream over spans of
+ * cycle time.
+ */
+struct snd_dice_drift {
+	snd_pcm_uframes_t last;
+	u32 last_ticks;
+	bool valid;
+	bool running;
+	unsigned long last_polled;	// In jiffies.
+
+	/* The observations in the current span. */
+	u64 frames;
+	u32 elapsed;		/* In ticks since the start of span. */
+	u32 sampled;		/* The elapsed ticks at the last observation. */
+	unsigned int count;
+	s64 sum_x;
+	s64 sum_xx;
+	s64 sum_r;
+	s64 sum_xr;
+
+	unsigned int rate;
+	s64 ppb;
+	u64 jitter_ppb;
+	unsigned int measurements;
+};
+
+/* Measurement of round-trip latency by marker looped back outside of unit. */
+#define SND_DICE_ROUNDTRIP_RESULTS	8
+
+enum snd_dice_roundtrip_state {
+	SND_DICE_ROUNDTRIP_IDLE = 0,
+	SND_DICE_ROUNDTRIP_ARMED,
+	SND_DICE_ROUNDTRIP_INJECTED,
+};
+
+/*
+ * Frames transferred since PCM transfer started. The counter stops when the
+ * interval between queries of position is too long to count frames.
+ */
+struct snd_dice_roundtrip_counter {
+	u64 frames;
+	snd_pcm_uframes_t last;
+	u64 last_ns;		/* CLOCK_MONOTONIC at the last query. */
+	bool running;
+	bool linked;		/* Started together with the counterpart. */
+};
+
+#define SND_DICE_ROUNDTRIP_NOT_DETECTED	-1
+#define SND_DICE_ROUNDTRIP_INVALID	-2
+
+struct snd_dice_roundtrip_result {
+	unsigned int rate;
+	unsigned int period_size;
+	int latency;		/* In frames, or SND_DICE_ROUNDTRIP_*. */
+};
+
+struct snd_dice_roundtrip {
+	unsigned int rx_stream;
+	unsigned int rx_channel;
+	unsigned int tx_stream;
+	unsigned int tx_channel;
+	enum snd_dice_roundtrip_state state;
+	struct snd_dice_roundtrip_counter rx;
+	struct snd_dice_roundtrip_counter tx;
+	u64 marker_frame;
+	unsigned int rate;
+	unsigned int period_size;
+
+	/* Cached per pair of rate and period size. */
+	struct snd_dice_roundtrip_result results[SND_DICE_ROUNDTRIP_RESULTS];
+	unsigned int result_count;
+};
+
+// Shadow of registers in global section, refreshed by notification.
+struct snd_dice_global_shadow {
+	u32 clock_select;
+	u32 enable;
+	u32 status;
+	u32 ext_status;
+	u32 sample_rate;
+};
+
+/* Defined for userspace in dice-uapi.h. */
+#define SND_DICE_EXT_SOURCE_COUNT	SNDRV_FIREWIRE_DICE_EXT_SOURCE_COUNT
+
+/* Read-only control elements for the status of clock. */
+enum snd_dice_control {
+	SND_DICE_CONTROL_CLOCK_SOURCE = 0,
+	SND_DICE_CONTROL_NOMINAL_RATE,
+	SND_DICE_CONTROL_CLOCK_LOCKED,
+	SND_DICE_CONTROL_EXT_LOCKED,
+	SND_DICE_CONTROL_EXT_SLIPS,
+	SND_DICE_CONTROL_EXT_UNLOCKS,
+	SND_DICE_CONTROL_COUNT,
+};
+
 struct snd_dice {
 	struct snd_card *card;
 	struct fw_unit *unit;
@@ -85,19 +271,47 @@ struct snd_dice {
 	unsigned int sync_offset;
 	unsigned int rsrv_offset;
 
+	/* For model database */
+	u32 vendor_id;
+	u32 model_id;
+	struct snd_dice_model model_override;	/* Loaded at runtime. */
+
 	unsigned int clock_caps;
+	u32 global_version;
 	unsigned int tx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
 	unsigned int rx_pcm_chs[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT];
 	unsigned int tx_midi_ports[MAX_STREAMS];
 	unsigned int rx_midi_ports[MAX_STREAMS];
+	/* In frames, for A/D and D/A conversion. Zero if unknown. */
+	unsigned int tx_converter_latency[SND_DICE_RATE_MODE_COUNT];
+	unsigned int rx_converter_latency[SND_DICE_RATE_MODE_COUNT];
+	char tx_channel_names[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT][SND_DICE_CHANNEL_NAMES_SIZE];
+	char rx_channel_names[MAX_STREAMS][SND_DICE_RATE_MODE_COUNT][SND_DICE_CHANNEL_NAMES_SIZE];
+
+	/* For protocol extension. The size is zero if not available. */
+	struct snd_dice_ext_section_info ext_sections[SND_DICE_EXT_SECTION_COUNT];
+	struct delayed_work meter_work;
+	struct snd_firewire_dice_meter_ring *meter_ring;
+	atomic_t meter_users;	/* The number of mappings. */
 
 	struct fw_address_handler notification_handler;
 	int owner_generation;
 	u32 notification_bits;
+	u32 pending_notification_bits;
+	struct work_struct notification_work;
+	struct snd_dice_global_shadow global_shadow;
+	struct snd_firewire_dice_clock_stats clock_stats;
+	struct snd_ctl_elem_id control_ids[SND_DICE_CONTROL_COUNT];
+
+	/* For reload of stream formats, and change of rate by external source */
+	struct work_struct format_work;
+	u32 format_change_bits;	/* NOTIFY_*_CFG_CHG and NOTIFY_LOCK_CHG */
+	struct work_struct detect_work;
+	unsigned int undetected_modes;
 
 	/* For uapi */
-	int dev_lock_count; /* > 0 driver, < 0 userspace */
-	bool dev_lock_changed;
+	atomic_t dev_lock_count; /* > 0 driver, < 0 userspace */
+	atomic_t dev_lock_changed;
 	wait_queue_head_t hwdep_wait;
 
 	/* For streaming */
@@ -105,8 +319,19 @@ struct snd_dice {
 	struct fw_iso_resources rx_resources[MAX_STREAMS];
 	struct amdtp_stream tx_stream[MAX_STREAMS];
 	struct amdtp_stream rx_stream[MAX_STREAMS];
+	struct snd_dice_pcm_position tx_pcm_position[MAX_STREAMS];
+	struct snd_dice_pcm_position rx_pcm_position[MAX_STREAMS];
+	struct snd_dice_drift drift;
+	int link_offset;	/* In frames, of tx stream 1 against 0. */
+	bool link_offset_valid;
+	struct snd_dice_roundtrip roundtrip;
 	bool global_enabled:1;
 	bool disable_double_pcm_frames:1;
+	bool model_overridden:1;
+	bool formats_cached:1;
+	bool low_latency:1;
+	bool midi_only:1;
+	bool params_stale:1;
 	struct completion clock_accepted;
 	unsigned int substreams_counter;
 
@@ -211,27 +436,71 @@ int snd_dice_stream_reserve_duplex(struct snd_dice *dice, unsigned int rate,
 				   unsigned int events_per_period,
 				   unsigned int events_per_buffer);
 void snd_dice_stream_update_duplex(struct snd_dice *dice);
+void snd_dice_stream_reload_formats(struct work_struct *work);
+void snd_dice_stream_detect_remaining_formats(struct work_struct *work);
 int snd_dice_stream_detect_current_formats(struct snd_dice *dice);
+int snd_dice_stream_check_formats(struct snd_dice *dice,
+			unsigned int clock_caps,
+			const unsigned int (*tx_pcm_chs)[SND_DICE_RATE_MODE_COUNT],
+			const unsigned int (*rx_pcm_chs)[SND_DICE_RATE_MODE_COUNT],
+			const unsigned int *tx_midi_ports,
+			const unsigned int *rx_midi_ports);
 
 int snd_dice_stream_lock_try(struct snd_dice *dice);
 void snd_dice_stream_lock_release(struct snd_dice *dice);
+void snd_dice_stream_retry_detection(struct snd_dice *dice);
 
 int snd_dice_create_pcm(struct snd_dice *dice);
+void snd_dice_pcm_get_drift(struct snd_dice *dice,
+			    struct snd_firewire_dice_drift *estimate);
 
 int snd_dice_create_hwdep(struct snd_dice *dice);
 
+int snd_dice_cache_restore(struct snd_dice *dice);
+void snd_dice_cache_store(struct snd_dice *dice);
+void snd_dice_cache_clear(void);
+
 void snd_dice_create_proc(struct snd_dice *dice);
 
+int snd_dice_create_control(struct snd_dice *dice);
+void snd_dice_control_notify(struct snd_dice *dice,
+			     const struct snd_dice_global_shadow *old);
+
 int snd_dice_create_midi(struct snd_dice *dice);
 
-int snd_dice_detect_tcelectronic_formats(struct snd_dice *dice);
 int snd_dice_detect_alesis_formats(struct snd_dice *dice);
 int snd_dice_detect_alesis_mastercontrol_formats(struct snd_dice *dice);
 int snd_dice_detect_extension_formats(struct snd_dice *dice);
-int snd_dice_detect_mytek_formats(struct snd_dice *dice);
-int snd_dice_detect_presonus_formats(struct snd_dice *dice);
-int snd_dice_detect_harman_formats(struct snd_dice *dice);
-int snd_dice_detect_focusrite_pro40_tcd3070_formats(struct snd_dice *dice);
-int snd_dice_detect_weiss_formats(struct snd_dice *dice);
+int snd_dice_extension_read(struct snd_dice *dice,
+			    enum snd_dice_ext_section section,
+			    unsigned int offset, void *buf, unsigned int len);
+int snd_dice_extension_write(struct snd_dice *dice,
+			     enum snd_dice_ext_section section,
+			     unsigned int offset, void *buf, unsigned int len);
+int snd_dice_extension_load_router(struct snd_dice *dice,
+				   enum snd_dice_rate_mode mode);
+
+int snd_dice_create_meter(struct snd_dice *dice);
+void snd_dice_destroy_meter(struct snd_dice *dice);
+int snd_dice_router_read_config(struct snd_dice *dice, void __user *arg);
+int snd_dice_router_write_config(struct snd_dice *dice, void __user *arg);
+
+void snd_dice_create_roundtrip(struct snd_dice *dice,
+			       struct snd_info_entry *root);
+void snd_dice_roundtrip_start(struct snd_dice *dice,
+			      struct snd_pcm_substream *substream);
+void snd_dice_roundtrip_stop(struct snd_dice *dice,
+			     struct snd_pcm_substream *substream);
+void snd_dice_roundtrip_playback(struct snd_dice *dice,
+				 struct snd_pcm_substream *substream,
+				 snd_pcm_uframes_t processed);
+void snd_dice_roundtrip_capture(struct snd_dice *dice,
+				struct snd_pcm_substream *substream,
+				snd_pcm_uframes_t processed);
+
+const struct snd_dice_model *snd_dice_model_lookup(struct snd_dice *dice);
+int snd_dice_model_detect_formats(struct snd_dice *dice,
+				  const struct snd_dice_model *model);
+void snd_dice_model_reload_formats(struct snd_dice *dice, bool *changed);
 
 #endif